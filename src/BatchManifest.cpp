@@ -0,0 +1,153 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include "BatchManifest.h"
+#include "compat.h"
+#include "die.h"
+#include "json.h"
+
+namespace {
+
+/* time points are either string ("1:23.5", "588s") or number (seconds) */
+bool get_time(const JSONValue &v, std::string *result)
+{
+    if (v.type() == JSONValue::STRING)
+        *result = v.as_string();
+    else if (v.type() == JSONValue::NUMBER)
+        *result = json_number(v.as_number());
+    else
+        return false;
+    return true;
+}
+
+void parse_job(const JSONValue &v, BatchJob *job)
+{
+    if (v.type() != JSONValue::OBJECT)
+        throw std::runtime_error("job is not an object");
+
+    auto &members = v.members();
+    for (auto m = members.begin(); m != members.end(); ++m) {
+        const std::string &key = m->first;
+        const JSONValue &value = m->second;
+        std::string *target = 0;
+        if (key == "id")
+            target = &job->id;
+        else if (key == "input")
+            target = &job->input;
+        else if (key == "output")
+            target = &job->output;
+        else if (key == "outdir")
+            target = &job->outdir;
+        else if (key == "cuesheet")
+            target = &job->cuesheet;
+        else if (key == "cuesheet_encoding")
+            target = &job->cuesheet_encoding;
+        else if (key == "start" || key == "end") {
+            if (!get_time(value, key == "start" ? &job->start : &job->end))
+                throw std::runtime_error("invalid " + key);
+            continue;
+        } else if (key == "ranges") {
+            if (value.type() != JSONValue::ARRAY)
+                throw std::runtime_error("ranges is not an array");
+            auto &e = value.elements();
+            for (auto r = e.begin(); r != e.end(); ++r) {
+                if (r->type() != JSONValue::STRING)
+                    throw std::runtime_error("range is not a string");
+                job->ranges.push_back(r->as_string());
+            }
+            continue;
+        } else if (key == "chapters") {
+            if (value.type() != JSONValue::BOOLEAN)
+                throw std::runtime_error("chapters is not a boolean");
+            job->chapters = value.as_bool();
+            continue;
+        } else
+            throw std::runtime_error("unknown key " + key);
+
+        if (value.type() != JSONValue::STRING)
+            throw std::runtime_error(key + " is not a string");
+        *target = value.as_string();
+    }
+
+    bool is_range = !job->start.empty() || !job->end.empty()
+                 || !job->ranges.empty() || !job->output.empty();
+    int nops = is_range + job->chapters + !job->cuesheet.empty();
+    if (nops != 1)
+        throw std::runtime_error("exactly one of range, chapters or "
+                                 "cuesheet is required");
+    if (is_range && job->output.empty())
+        throw std::runtime_error("output is required");
+    if (is_range && !job->ranges.empty()
+        && (!job->start.empty() || !job->end.empty()))
+        throw std::runtime_error("ranges and start/end are exclusive");
+    if (job->input.empty() && job->cuesheet.empty())
+        throw std::runtime_error("input is required");
+}
+
+} // end of empty namespace
+
+void parse_batch_job(const std::string &text, BatchJob *job)
+{
+    parse_job(JSONValue::parse(text), job);
+}
+
+std::string BatchJob::name() const
+{
+    return input.empty() ? cuesheet : input;
+}
+
+std::string BatchJob::key() const
+{
+    /*
+     * FNV-1a of the line number and the line, which are the same on every
+     * worker. line number tells apart identical lines.
+     */
+    char buf[32];
+    std::sprintf(buf, "%u:", lineno);
+    return fnv1a_hex(buf + text);
+}
+
+void load_batch_manifest(const std::string &filename,
+                         std::vector<BatchJob> *jobs)
+{
+    FILE *fp = aa_fopen(filename.c_str(), "rb");
+    if (!fp)
+        throw_file_error(filename, std::strerror(errno));
+    std::shared_ptr<FILE> __fp__(fp, std::fclose);
+
+    std::vector<BatchJob> result;
+    std::string line;
+    unsigned lineno = 0;
+    int c;
+    do {
+        c = std::getc(fp);
+        if (c != '\n' && c != EOF) {
+            line.push_back(c);
+            continue;
+        }
+        ++lineno;
+        if (line.find_first_not_of(" \t\r") != std::string::npos) {
+            BatchJob job;
+            job.lineno = lineno;
+            job.text = line;
+            try {
+                parse_batch_job(line, &job);
+            } catch (const std::exception &e) {
+                job.error = e.what();
+            }
+            result.push_back(job);
+        }
+        line.clear();
+    } while (c != EOF);
+    jobs->swap(result);
+}
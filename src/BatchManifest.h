@@ -0,0 +1,55 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef BatchManifest_H
+#define BatchManifest_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * a job in the manifest for --batch.
+ * operation is one of the following, as in the command line:
+ *   range:    output, and start/end or ranges
+ *   chapters: chapters = true
+ *   cuesheet: cuesheet (input is optional)
+ * time points are kept as given, in the format of -s/-e/-r.
+ */
+struct BatchJob {
+    unsigned lineno;
+    std::string id;     /* optional, echoed back by --serve */
+    std::string input;
+    std::string output;
+    std::string outdir;
+    std::string start;
+    std::string end;
+    std::vector<std::string> ranges;
+    bool chapters;
+    std::string cuesheet;
+    std::string cuesheet_encoding;
+    uint64_t cost;      /* size of input, for scheduling */
+    std::string error;  /* set when the line is malformed */
+    std::string text;   /* the line in the manifest */
+
+    BatchJob(): lineno(0), chapters(false), cost(0) {}
+    /* name of the job in messages */
+    std::string name() const;
+    /* identifies the job among workers sharing the manifest */
+    std::string key() const;
+};
+
+/* parse a job in JSON. throws std::runtime_error when malformed */
+void parse_batch_job(const std::string &text, BatchJob *job);
+
+/*
+ * load the manifest.
+ * each non-empty line is a JSON object describing a job.
+ * malformed lines are kept as jobs having error, so that they can be
+ * reported as failures of the jobs.
+ */
+void load_batch_manifest(const std::string &filename,
+                         std::vector<BatchJob> *jobs);
+
+#endif
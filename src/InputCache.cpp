@@ -0,0 +1,80 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cerrno>
+#include <cstring>
+#include "InputCache.h"
+
+void InputCache::open_input(M4ATrimmer *trimmer, const std::string &filename)
+{
+    aa_stat_t st;
+    if (aa_stat(filename.c_str(), &st) < 0)
+        throw_file_error(filename, std::strerror(errno));
+
+    std::shared_ptr<const M4ATrimmer> input = lookup(filename, st);
+    if (!input) {
+        /* parse outside of the lock, so that other lookups won't wait */
+        std::shared_ptr<M4ATrimmer> parsed = std::make_shared<M4ATrimmer>();
+        parsed->open_input(filename);
+        input = parsed;
+        insert(filename, st, input);
+    }
+    trimmer->open_input(*input);
+}
+
+std::shared_ptr<const M4ATrimmer>
+InputCache::lookup(const std::string &filename, const aa_stat_t &st)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_index.find(filename);
+    if (i == m_index.end())
+        return std::shared_ptr<const M4ATrimmer>();
+    auto e = i->second;
+    if (e->stat.size != st.size || e->stat.mtime != st.mtime
+        || e->stat.ino != st.ino)
+    {
+        erase(e);
+        return std::shared_ptr<const M4ATrimmer>();
+    }
+    m_entries.splice(m_entries.begin(), m_entries, e);
+    return e->input;
+}
+
+void InputCache::insert(const std::string &filename, const aa_stat_t &st,
+                        const std::shared_ptr<const M4ATrimmer> &input)
+{
+    size_t size = input->input_memory_usage();
+    if (size > m_capacity)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_index.find(filename);
+    if (i != m_index.end())
+        erase(i->second);
+    while (m_size + size > m_capacity)
+        erase(--m_entries.end());
+
+    Entry entry;
+    entry.filename = filename;
+    entry.stat = st;
+    entry.input = input;
+    entry.size = size;
+    m_entries.push_front(entry);
+    m_index[filename] = m_entries.begin();
+    m_size += size;
+}
+
+/*
+ * trimmers sharing the input of the erased entry keep it alive until
+ * they are done.
+ */
+void InputCache::erase(std::list<Entry>::iterator e)
+{
+    m_size -= e->size;
+    m_index.erase(e->filename);
+    m_entries.erase(e);
+}
@@ -0,0 +1,50 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef InputCache_H
+#define InputCache_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "M4ATrimmer.h"
+#include "compat.h"
+
+/*
+ * LRU cache of parsed inputs, bounded by estimated memory usage.
+ * an entry is invalidated when size, mtime or inode of the file has
+ * changed since it was parsed.
+ */
+class InputCache {
+    struct Entry {
+        std::string filename;
+        aa_stat_t stat;
+        std::shared_ptr<const M4ATrimmer> input;
+        size_t size;
+    };
+    std::list<Entry> m_entries;  /* most recently used first */
+    std::map<std::string, std::list<Entry>::iterator> m_index;
+    size_t m_capacity;
+    size_t m_size;
+    std::mutex m_mutex;
+public:
+    explicit InputCache(size_t capacity)
+        : m_capacity(capacity), m_size(0)
+    {}
+    /* open input of trimmer from the cache, parsing the file on miss */
+    void open_input(M4ATrimmer *trimmer, const std::string &filename);
+private:
+    std::shared_ptr<const M4ATrimmer> lookup(const std::string &filename,
+                                             const aa_stat_t &st);
+    void insert(const std::string &filename, const aa_stat_t &st,
+                const std::shared_ptr<const M4ATrimmer> &input);
+    void erase(std::list<Entry>::iterator e);
+
+    InputCache(const InputCache &);
+    InputCache &operator=(const InputCache &);
+};
+
+#endif
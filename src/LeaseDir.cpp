@@ -0,0 +1,169 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include "LeaseDir.h"
+#include "compat.h"
+#include "die.h"
+#include "json.h"
+
+LeaseDir::LeaseDir(const std::string &dir, unsigned timeout)
+    : m_dir(dir), m_timeout(timeout ? timeout : 1), m_closing(false)
+{
+    if (m_dir.size() && !std::strchr("/\\", m_dir[m_dir.size() - 1]))
+        m_dir.push_back('/');
+
+    std::random_device rd;
+    std::stringstream ss;
+    ss << std::hex << rd() << rd() << "-" << aa_timer();
+    m_owner = ss.str();
+
+    m_heartbeat = std::thread(&LeaseDir::heartbeat, this);
+}
+
+LeaseDir::~LeaseDir()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closing = true;
+        m_cond.notify_all();
+    }
+    m_heartbeat.join();
+}
+
+LeaseDir::Status LeaseDir::status(const std::string &key, std::string *error)
+{
+    std::string name = path(key, ".status");
+    FILE *fp = aa_fopen(name.c_str(), "rb");
+    if (!fp)
+        return PENDING;
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof buf, fp)) > 0)
+        text.append(buf, n);
+    std::fclose(fp);
+    try {
+        JSONValue v = JSONValue::parse(text);
+        const JSONValue *ok = v.get("ok");
+        if (ok && ok->type() == JSONValue::BOOLEAN && ok->as_bool())
+            return SUCCEEDED;
+        const JSONValue *msg = v.get("error");
+        if (error)
+            *error = msg && msg->type() == JSONValue::STRING
+                         ? msg->as_string() : "failed";
+    } catch (const std::exception &) {
+        if (error)
+            *error = name + ": malformed status";
+    }
+    return FAILED;
+}
+
+bool LeaseDir::acquire(const std::string &key)
+{
+    std::string lease = path(key, ".lease");
+    if (!create_lease(lease)) {
+        aa_stat_t st;
+        if (aa_stat(lease.c_str(), &st) < 0
+            || std::time(0) - st.mtime <= int64_t(m_timeout))
+            return false;
+        /*
+         * expired. move it aside, so that only one of the workers
+         * trying to take over succeeds.
+         */
+        std::string stale = lease + "." + m_owner;
+        if (aa_rename(lease.c_str(), stale.c_str()) < 0)
+            return false;
+        bool expired = aa_stat(stale.c_str(), &st) == 0
+                    && std::time(0) - st.mtime > int64_t(m_timeout);
+        aa_unlink(stale.c_str());
+        /* otherwise it was refreshed, and will be recreated by heartbeat */
+        if (!expired || !create_lease(lease))
+            return false;
+    }
+    /* it could have been finished before the lease was taken */
+    switch (status(key)) {
+    case SUCCEEDED:
+        aa_unlink(lease.c_str());
+        return false;
+    case FAILED:
+        aa_unlink(path(key, ".status").c_str());
+        break;
+    default:
+        break;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_held.insert(key);
+    return true;
+}
+
+void LeaseDir::release(const std::string &key, const std::string &status)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_held.erase(key);
+    std::string name = path(key, ".status");
+    std::string tmpname = name + "." + m_owner;
+    FILE *fp = aa_fopen(tmpname.c_str(), "wb");
+    if (!fp)
+        throw_file_error(tmpname, std::strerror(errno));
+    std::fprintf(fp, "%s\n", status.c_str());
+    if (std::fclose(fp) != 0 || aa_rename(tmpname.c_str(), name.c_str()))
+        throw_file_error(name, std::strerror(errno));
+    aa_unlink(path(key, ".lease").c_str());
+}
+
+std::string LeaseDir::path(const std::string &key, const char *ext) const
+{
+    return m_dir + key + ext;
+}
+
+bool LeaseDir::create_lease(const std::string &lease)
+{
+    FILE *fp = aa_fopen(lease.c_str(), "wbx");
+    if (!fp)
+        return false;
+    std::fprintf(fp, "%s\n", m_owner.c_str());
+    std::fclose(fp);
+    return true;
+}
+
+/*
+ * rewrite the leases held by this worker, to refresh mtime.
+ * a lease taken over by another worker (after we stalled) is left alone.
+ * lock is held, so that a lease won't be recreated after release.
+ */
+void LeaseDir::heartbeat()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_closing) {
+        m_cond.wait_for(lock, std::chrono::milliseconds(m_timeout * 1000 / 3));
+        for (auto key = m_held.begin(); key != m_held.end(); ++key) {
+            std::string lease = path(*key, ".lease");
+            char owner[128] = { 0 };
+            FILE *fp = aa_fopen(lease.c_str(), "rb");
+            if (fp) {
+                if (!std::fgets(owner, sizeof owner, fp))
+                    owner[0] = 0;
+                std::fclose(fp);
+            }
+            if (fp && m_owner + "\n" != owner)
+                continue;
+            if ((fp = aa_fopen(lease.c_str(), "wb")) != 0) {
+                std::fprintf(fp, "%s\n", m_owner.c_str());
+                std::fclose(fp);
+            }
+        }
+    }
+}
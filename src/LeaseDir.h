@@ -0,0 +1,65 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef LeaseDir_H
+#define LeaseDir_H
+
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+/*
+ * Directory of lease files shared by batch workers (possibly on many
+ * hosts over a shared filesystem), so that each job is run by only one
+ * of them.
+ *
+ * <key>.lease is created exclusively by the worker running the job, and
+ * its mtime is refreshed as heartbeat. A lease not refreshed within the
+ * timeout is taken over by another worker. When the job is done,
+ * <key>.status is written and the lease is removed.
+ * Status is a JSON object having "ok", and "error" when the job failed.
+ * A failed job is run again when it is acquired next time.
+ *
+ * Clocks of the hosts are assumed to be roughly in sync. In a rare race
+ * on takeover, a job can be run twice.
+ */
+class LeaseDir {
+    std::string m_dir;
+    unsigned m_timeout;
+    std::string m_owner;  /* token identifying this worker */
+    std::set<std::string> m_held;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_closing;
+    std::thread m_heartbeat;
+public:
+    /* timeout in seconds */
+    LeaseDir(const std::string &dir, unsigned timeout);
+    ~LeaseDir();
+    unsigned timeout() const { return m_timeout; }
+    enum Status { PENDING, SUCCEEDED, FAILED };
+    /*
+     * result of the job in the status. message of a failed job is stored
+     * into error (when given). malformed status is taken as failure.
+     */
+    Status status(const std::string &key, std::string *error=0);
+    /*
+     * returns false when the job is leased by another live worker, or
+     * has succeeded. status of a failed run is removed on success.
+     */
+    bool acquire(const std::string &key);
+    /* write status (in JSON) of the job, and remove the lease */
+    void release(const std::string &key, const std::string &status);
+private:
+    std::string path(const std::string &key, const char *ext) const;
+    bool create_lease(const std::string &lease);
+    void heartbeat();
+
+    LeaseDir(const LeaseDir &);
+    LeaseDir &operator=(const LeaseDir &);
+};
+
+#endif
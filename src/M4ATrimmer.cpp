@@ -6,14 +6,20 @@
 # include "config.h"
 #endif
 #include "M4ATrimmer.h"
+#include <cerrno>
+#include <cstdlib>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <random>
 #include "bitstream.h"
+#include "compat.h"
+#include "json.h"
 
 void parse_ASC(const void *data, size_t size,
                uint8_t *aot, uint32_t *sample_rate)
 {
-    BitStream bs(static_cast<const uint8_t *>(data), size);
+    BitReader bs(static_cast<const uint8_t *>(data), size);
     *aot = bs.get(5);
     if (*aot != 2 && *aot != 5 && *aot != 29)
         throw std::runtime_error("Unsupported AudioSpecificConfig");
@@ -25,14 +31,14 @@ void parse_ASC(const void *data, size_t size,
     uint8_t chan_config    = bs.get(4);
     if (*aot == 5 || *aot == 29) {
         *sample_rate = sftab[bs.get(4)];
-        bs.advance(5); // AOT
+        bs.skip(5); // AOT
     }
     // GASpecificConfig
-    bs.advance(1); // frameLengthFlag
-    if (bs.get(1)) bs.advance(14); // dependsOnCoreCoder
-    bs.advance(1); // extensionFlag
+    bs.skip(1); // frameLengthFlag
+    if (bs.get(1)) bs.skip(14); // dependsOnCoreCoder
+    bs.skip(1); // extensionFlag
     if (!chan_config) {
-        bs.advance(10); // element_instance_tag, object_type, sf_index
+        bs.skip(10); // element_instance_tag, object_type, sf_index
         uint8_t nfront  = bs.get(4);
         uint8_t nside   = bs.get(4);
         uint8_t nback   = bs.get(4);
@@ -50,41 +56,42 @@ void parse_ASC(const void *data, size_t size,
                 nfront_channels += 2;
             else
                 nfront_channels += 1;
-            bs.advance(4); // element_tag_select
+            bs.skip(4); // element_tag_select
         }
         for (uint8_t i = 0; i < nside; ++i) {
             if (bs.get(1)) // is_cpe
                 nside_channels += 2;
             else
                 nside_channels += 1;
-            bs.advance(4); // element_tag_select
+            bs.skip(4); // element_tag_select
         }
         for (uint8_t i = 0; i < nback; ++i) {
             if (bs.get(1)) // is_cpe
                 nback_channels += 2;
             else
                 nback_channels += 1;
-            bs.advance(4); // element_tag_select
+            bs.skip(4); // element_tag_select
         }
         for (uint8_t i = 0; i < nlfe; ++i)
-            bs.advance(4);
+            bs.skip(4);
         for (uint8_t i = 0; i < nassoc; ++i)
-            bs.advance(4);
+            bs.skip(4);
         for (uint8_t i = 0; i < ncc; ++i)
-            bs.advance(5);
-        // byte align
-        bs.advance((8 - (bs.position() & 7)) & 7);
-        uint8_t comment_len = bs.get(1);
-        bs.advance(8 * comment_len);
+            bs.skip(5);
+        bs.byteAlign();
+        uint8_t comment_len = bs.get(8);
+        bs.skip(8 * comment_len);
     }
-    if (size * 8 - bs.position() >= 16) {
+    if (bs.overrun())
+        throw std::runtime_error("AudioSpecificConfig is truncated");
+    if (bs.remaining() >= 16) {
         if (bs.get(11) == 0x2b7) {
             uint8_t tmp = bs.get(5);
             if (tmp == 5 && bs.get(1)) {
                 *aot = tmp;
                 *sample_rate = sftab[bs.get(4)];
             }
-            if (size * 8 - bs.position() >= 12) {
+            if (bs.remaining() >= 12) {
                 if (bs.get(11) == 0x548 && bs.get(1))
                     *aot = 29;
             }
@@ -92,11 +99,78 @@ void parse_ASC(const void *data, size_t size,
     }
 }
 
+namespace {
+
+/* copy strings and binary of the item into the pool */
+void copy_itunes_metadata(StringPool *pool, lsmash_itunes_metadata_t *item)
+{
+    if (item->meaning)
+        item->meaning = const_cast<char*>(pool->append(item->meaning));
+    if (item->name)
+        item->name = const_cast<char*>(pool->append(item->name));
+
+    if (item->type == ITUNES_METADATA_TYPE_STRING)
+        item->value.string =
+            const_cast<char*>(pool->append(item->value.string));
+    else if (item->type == ITUNES_METADATA_TYPE_BINARY) {
+        const char *d = reinterpret_cast<char*>(item->value.binary.data);
+        d = pool->append(d, item->value.binary.size);
+        item->value.binary.data =
+            reinterpret_cast<uint8_t*>(const_cast<char*>(d));
+    }
+}
+
+std::pair<lsmash_itunes_metadata_item, std::string>
+tag_key(const lsmash_itunes_metadata_t &item)
+{
+    return std::make_pair(item.item,
+                          item.name ? std::string(item.name) : std::string());
+}
+
+/*
+ * create a temporary file of unique name in the temporary directory,
+ * so that concurrent writers (and outputs without a filename, such as
+ * memory sinks of libm4acut) don't clash.
+ */
+FILE *create_temporary(const char *suffix, std::string *path)
+{
+    static std::atomic<unsigned> counter(0);
+    static const std::string token = []() {
+        std::random_device rd;
+        std::stringstream ss;
+        ss << std::hex << rd() << rd();
+        return ss.str();
+    }();
+    const char *dir = std::getenv("TMPDIR");
+#ifdef _WIN32
+    if (!dir || !*dir) dir = std::getenv("TEMP");
+    if (!dir || !*dir) dir = ".";
+#else
+    if (!dir || !*dir) dir = "/tmp";
+#endif
+    for (int i = 0; i < 100; ++i) {
+        std::stringstream ss;
+        ss << dir << "/m4acut-" << token << "-" << counter++ << suffix;
+        FILE *fp = aa_fopen(ss.str().c_str(), "wbx");
+        if (fp) {
+            *path = ss.str();
+            return fp;
+        }
+        if (errno != EEXIST)
+            throw_file_error(ss.str(), std::strerror(errno));
+    }
+    throw std::runtime_error("cannot create temporary file");
+}
+
+} // end of empty namespace
+
 void M4ATrimmer::open_input(const std::string &filename)
 {
     m_input.movie = new_movie();
     lsmash_root_t *mov = m_input.movie.get();
     m_input.file_params = std::make_shared<FileParameters>(filename, 1);
+    m_input.lock = std::make_shared<std::mutex>();
+    m_input.filename = filename;
     {
         lsmash_file_t *f;
         lsmash_file_parameters_t *fp = m_input.file_params.get();
@@ -112,27 +186,92 @@ void M4ATrimmer::open_input(const std::string &filename)
         throw std::runtime_error("available track not found in the movie");
     fetch_track_info(&m_input.track, track_id);
 
+    std::shared_ptr<Metadata> metadata = std::make_shared<Metadata>();
     uint32_t num_metadata = lsmash_count_itunes_metadata(mov);
     for (uint32_t i = 0; i < num_metadata; ++i) {
         lsmash_itunes_metadata_t item;
         if (lsmash_get_itunes_metadata(mov, i + 1, &item))
             break;
-        if (!parse_iTunSMPB(item))
-            populate_itunes_metadata(item);
+        if (!parse_iTunSMPB(item)) {
+            lsmash_itunes_metadata_t res = item;
+            copy_itunes_metadata(&metadata->pool, &res);
+            metadata->items[tag_key(res)] = res;
+        } else if (m_input.has_iTunSMPB) {
+            metadata->iTunSMPB = item;
+            copy_itunes_metadata(&metadata->pool, &metadata->iTunSMPB);
+        }
         lsmash_cleanup_itunes_metadata(&item);
     }
+    m_input.metadata = metadata;
+    reset_tags();
     fetch_chapters();
     if (!m_input.track.edits.count()) {
         int64_t duration = m_input.track.media_params.duration;
         m_input.track.edits.add_entry(0, duration);
     }
+    auto title = metadata->items.find(
+            std::make_pair(ITUNES_METADATA_ITEM_TITLE, std::string()));
+    if (title != metadata->items.end()
+        && title->second.type == ITUNES_METADATA_TYPE_STRING)
+        m_input.name = title->second.value.string;
+    else {
+        size_t pos = filename.find_last_of("/\\");
+        m_input.name = filename.substr(pos == std::string::npos ? 0 : pos + 1);
+        if ((pos = m_input.name.find_last_of('.')) != std::string::npos)
+            m_input.name.erase(pos);
+    }
+}
+
+void M4ATrimmer::open_input(const M4ATrimmer &source)
+{
+    m_input = source.m_input;
+    m_joined.clear();
+    reset_tags();
+    clear_cut_ranges();
+}
+
+size_t M4ATrimmer::input_memory_usage() const
+{
+    /*
+     * L-SMASH keeps sample tables and the timeline constructed from
+     * them, which is some hundred bytes per sample including allocator
+     * overhead.
+     */
+    size_t size = 64 * 1024 + m_input.track.num_access_units() * 128;
+    if (m_input.metadata)
+        size += m_input.metadata->pool.size();
+    return size;
+}
+
+void M4ATrimmer::append_input(const std::string &filename)
+{
+    M4ATrimmer other;
+    other.open_input(filename);
+    const Track &t = m_input.track, &u = other.m_input.track;
+    if (t.asc != u.asc || t.timescale() != u.timescale())
+        throw_file_error(filename, "AudioSpecificConfig doesn't match");
+    m_joined.push_back(other.m_input);
 }
 
 void M4ATrimmer::open_output(const std::string &filename)
 {
     m_output.movie = new_movie();
-    lsmash_root_t *mov = m_output.movie.get();
     m_output.file_params = std::make_shared<FileParameters>(filename, 0);
+    m_output.filename = filename;
+    setup_output();
+}
+
+void M4ATrimmer::open_output(const std::string &name, const OutputIO &io)
+{
+    m_output.movie = new_movie();
+    m_output.file_params = std::make_shared<FileParameters>(io);
+    m_output.filename = name;
+    setup_output();
+}
+
+void M4ATrimmer::setup_output()
+{
+    lsmash_root_t *mov = m_output.movie.get();
     {
         lsmash_file_parameters_t *ofp = m_output.file_params.get(),
                                  *ifp = m_input.file_params.get();
@@ -141,6 +280,10 @@ void M4ATrimmer::open_output(const std::string &filename)
         ofp->minor_version = ifp->minor_version;
         ofp->brands        = ifp->brands;
         ofp->brand_count   = ifp->brand_count;
+        if (m_layout.chunk_duration > 0.0)
+            ofp->max_chunk_duration = m_layout.chunk_duration;
+        if (m_layout.chunk_size > 0)
+            ofp->max_chunk_size = m_layout.chunk_size;
         lsmash_file_t *f;
         DieIF((f = lsmash_set_file(mov, ofp)) == 0);
     }
@@ -156,53 +299,39 @@ void M4ATrimmer::open_output(const std::string &filename)
 void M4ATrimmer::select_cut_point(const TimeSpec &startspec,
                                   const TimeSpec &endspec)
 {
-    double starttime = startspec.is_samples ?
-        double(startspec.value.samples) / m_input.track.sample_rate
-      : startspec.value.seconds;
-    double endtime = endspec.is_samples ?
-        double(endspec.value.samples) / m_input.track.sample_rate
-      : endspec.value.seconds;
-
-    int64_t start = int64_t(starttime * timescale() + .5);
-    int64_t end = int64_t(endtime * timescale() + .5);
-
-    if (start > (int64_t)duration())
-        throw std::runtime_error("the start position for trimming exceeds "
-                                 "the length of input");
-    if (end <= 0)
-        end = duration();
-    if (end <= start)
-        throw std::runtime_error("the end position of trimming is before "
-                                 "the start position");
+    std::vector<TimeRange> ranges;
+    ranges.push_back(std::make_pair(startspec, endspec));
+    select_cut_ranges(ranges);
+}
 
-    m_output.track.edits = m_input.track.edits;
-    MP4Edits &edits = m_output.track.edits;
-    edits.crop(start, end);
-    int64_t media_start = edits.minimum_media_position();
-    int64_t media_end   = edits.maximum_media_position();
-    uint32_t au_size = m_input.track.access_unit_size();
-    m_cut_start = m_current_au =
-        std::max(static_cast<int64_t>(0), media_start - au_size) / au_size;
-    m_cut_end = (media_end + au_size - 1) / au_size;
-    if (m_input.track.aot != 2) {
-        unsigned delay = unsigned(962.0 / m_input.track.sample_rate * timescale() + .5);
-		if (m_cut_end * au_size - media_end < delay)
-			++m_cut_end;
-	}
-    uint64_t num_au = m_input.track.num_access_units();
-    if (m_cut_end > num_au) m_cut_end = num_au;
-    if (m_cut_start > 0)
-        edits.shift(-1 * m_cut_start * au_size);
-
-    unsigned count = m_output.track.edits.count();
-    for (unsigned i = 0; i < count; ++i) {
-        lsmash_edit_t edit = { 0 };
-        edit.duration   = m_output.track.edits.duration(i);
-        edit.start_time = m_output.track.edits.offset(i);
-        edit.rate       = ISOM_EDIT_MODE_NORMAL;
-        lsmash_create_explicit_timeline_map(m_output.movie.get(),
-                                            m_output.track.id(), edit);
+void M4ATrimmer::select_cut_ranges(const std::vector<TimeRange> &ranges)
+{
+    std::vector<std::pair<int64_t, int64_t> > windows;
+    for (auto r = ranges.begin(); r != ranges.end(); ++r) {
+        int64_t start = to_media_time(r->first);
+        int64_t end   = to_media_time(r->second);
+
+        if (start > (int64_t)duration())
+            throw std::runtime_error("the start position for trimming "
+                                     "exceeds the length of input");
+        if (end <= 0)
+            end = duration();
+        if (end <= start)
+            throw std::runtime_error("the end position of trimming is before "
+                                     "the start position");
+        if (windows.size() && start < windows.back().second)
+            throw std::runtime_error("ranges for trimming must be in "
+                                     "ascending order without overlap");
+        windows.push_back(std::make_pair(start, end));
     }
+    if (!windows.size())
+        throw std::runtime_error("no range to trim is given");
+
+    MP4Edits edits = m_input.track.edits;
+    edits.crop(windows);
+    clear_cut_ranges();
+    add_cut_edits(0, edits);
+    rewind();
 }
 
 void M4ATrimmer::select_chapter(unsigned nth)
@@ -218,18 +347,59 @@ void M4ATrimmer::select_chapter(unsigned nth)
     set_track_tag(nth + 1, m_input.chapters.size());
 }
 
+void M4ATrimmer::select_joined_inputs()
+{
+    clear_cut_ranges();
+    double offset = 0.0;
+    for (size_t i = 0; i <= m_joined.size(); ++i) {
+        const Input &input = source(i);
+        add_cut_edits(i, input.track.edits);
+        for (auto c = input.chapters.begin(); c != input.chapters.end(); ++c)
+            m_output.chapters.push_back(std::make_pair(offset + c->first,
+                                                       c->second));
+        if (!input.chapters.size())
+            m_output.chapters.push_back(std::make_pair(offset, input.name));
+        offset += double(input.track.duration()) / input.track.timescale();
+    }
+    rewind();
+    /* these came from the first input, and don't fit the joined one */
+    remove_tag(ITUNES_METADATA_ITEM_TITLE);
+    remove_tag(ITUNES_METADATA_ITEM_TRACK_NUMBER);
+}
+
+void M4ATrimmer::select_all()
+{
+    clear_cut_ranges();
+    CutRange r = { 0, 0, m_input.track.num_access_units(), 0 };
+    m_cut_ranges.push_back(r);
+    m_output.track.edits = m_input.track.edits;
+    m_output.chapters = m_input.chapters;
+    m_output.verbatim = true;
+    rewind();
+}
+
 bool M4ATrimmer::copy_next_access_unit()
 {
-    if (m_current_au == m_cut_end)
+    while (m_current_range < m_cut_ranges.size()
+           && m_current_au == m_cut_ranges[m_current_range].end)
+    {
+        if (++m_current_range < m_cut_ranges.size())
+            m_current_au = m_cut_ranges[m_current_range].begin;
+    }
+    if (m_current_range == m_cut_ranges.size())
         return false;
-    lsmash_sample_t *sample =
-        lsmash_get_sample_from_media_timeline(m_input.movie.get(),
-                                              m_input.track.id(),
-                                              m_current_au + 1);
+    const Input &input = source(m_cut_ranges[m_current_range].input);
+    lsmash_sample_t *sample;
+    {
+        std::lock_guard<std::mutex> lock(*input.lock);
+        sample = lsmash_get_sample_from_media_timeline(input.movie.get(),
+                                                       input.track.id(),
+                                                       m_current_au + 1);
+    }
     if (!sample)
         return false;
     uint32_t au_size = m_input.track.access_unit_size();
-    sample->dts = sample->cts = (m_current_au - m_cut_start) * au_size;
+    sample->dts = sample->cts = m_output_au * au_size;
     /*
      * XXX: leaks a sample when lsmash_append_sample() fails.
      * Otherwise samples is deallocated internally by lsmash_append_sample()
@@ -237,6 +407,7 @@ bool M4ATrimmer::copy_next_access_unit()
     DieIF(lsmash_append_sample(m_output.movie.get(),
                                m_output.track.id(), sample));
     ++m_current_au;
+    ++m_output_au;
     return true;
 }
 
@@ -245,10 +416,25 @@ void M4ATrimmer::finish_write(lsmash_adhoc_remux_callback cb, void *cookie)
     lsmash_root_t *mov = m_output.movie.get();
     uint32_t au_size = m_input.track.access_unit_size();
     DieIF(lsmash_flush_pooled_samples(mov, m_output.track.id(), au_size));
-    if (m_output.track.edits.count() == 1)
-        set_iTunSMPB();
-    for (auto e = m_itunes_metadata.begin(); e != m_itunes_metadata.end(); ++e)
-        lsmash_set_itunes_metadata(mov, e->second);
+    write_edits();
+    write_chapters();
+    std::vector<lsmash_itunes_metadata_t> items;
+    get_itunes_metadata(&items);
+    char smpb[256];
+    if (m_output.track.edits.count() == 1
+        && (!m_output.verbatim || m_input.has_iTunSMPB))
+    {
+        lsmash_itunes_metadata_t tag = iTunSMPB_tag(smpb);
+        auto e = items.begin();
+        while (e != items.end() && tag_key(*e) < tag_key(tag))
+            ++e;
+        if (e != items.end() && tag_key(*e) == tag_key(tag))
+            *e = tag;
+        else
+            items.insert(e, tag);
+    }
+    for (auto e = items.begin(); e != items.end(); ++e)
+        DieIF(lsmash_set_itunes_metadata(mov, *e));
 
     lsmash_adhoc_remux_t param;
     param.func = cb;
@@ -257,6 +443,178 @@ void M4ATrimmer::finish_write(lsmash_adhoc_remux_callback cb, void *cookie)
     DieIF(lsmash_finish_movie(mov, &param));
 }
 
+int64_t M4ATrimmer::to_media_time(const TimeSpec &spec)
+{
+    double seconds = spec.is_samples ?
+        double(spec.value.samples) / m_input.track.sample_rate
+      : spec.value.seconds;
+    return int64_t(seconds * timescale() + .5);
+}
+
+void M4ATrimmer::clear_cut_ranges()
+{
+    m_cut_ranges.clear();
+    m_output.track.edits = MP4Edits();
+    m_output.chapters.clear();
+    m_output.verbatim = false;
+}
+
+/*
+ * Determine the access units needed for each edit, and append the edits
+ * to the output with media offset rebased onto the output media timeline,
+ * where the needed access units are laid out in order.
+ * Edits sharing access units (or adjacent ones) are merged into the same
+ * range, so that each access unit is copied only once.
+ */
+void M4ATrimmer::add_cut_edits(size_t input, const MP4Edits &edits)
+{
+    const Track &track = source(input).track;
+    uint32_t au_size = track.access_unit_size();
+    uint64_t num_au = track.num_access_units();
+    unsigned delay = 0;
+    if (track.aot != 2)
+        delay = unsigned(962.0 / track.sample_rate * track.timescale() + .5);
+
+    for (unsigned i = 0; i < edits.count(); ++i) {
+        int64_t media_start = edits.offset(i);
+        int64_t media_end   = media_start + edits.duration(i);
+        if (media_start < 0) {
+            m_output.track.edits.add_entry(media_start, edits.duration(i));
+            continue;
+        }
+        CutRange r;
+        r.input = input;
+        r.begin = std::max(static_cast<int64_t>(0),
+                           media_start - au_size) / au_size;
+        r.end = (media_end + au_size - 1) / au_size;
+        if (r.end * au_size - media_end < delay)
+            ++r.end;
+        if (r.end > num_au) r.end = num_au;
+        r.base = 0;
+        if (m_cut_ranges.size())
+            r.base = m_cut_ranges.back().base
+                   + m_cut_ranges.back().end - m_cut_ranges.back().begin;
+
+        CutRange *last = m_cut_ranges.size() ? &m_cut_ranges.back() : 0;
+        if (last && last->input == input
+            && r.begin >= last->begin && r.begin <= last->end)
+        {
+            if (r.end > last->end)
+                last->end = r.end;
+        } else {
+            m_cut_ranges.push_back(r);
+            last = &m_cut_ranges.back();
+        }
+        int64_t rebase = int64_t(last->base) - int64_t(last->begin);
+        m_output.track.edits.add_entry(media_start + rebase * au_size,
+                                       edits.duration(i));
+    }
+}
+
+void M4ATrimmer::rewind()
+{
+    if (!m_cut_ranges.size())
+        throw std::runtime_error("nothing to cut in the given range");
+    m_cut_start = m_cut_ranges.front().begin;
+    m_cut_end   = m_cut_ranges.back().end;
+    m_current_range = 0;
+    m_current_au = m_cut_start;
+    m_output_au = 0;
+}
+
+void M4ATrimmer::write_edits()
+{
+    MP4Edits &edits = m_output.track.edits;
+    for (unsigned i = 0; i < edits.count(); ++i) {
+        lsmash_edit_t edit = {};
+        edit.duration   = edits.duration(i);
+        edit.start_time = edits.offset(i);
+        edit.rate       = ISOM_EDIT_MODE_NORMAL;
+        lsmash_create_explicit_timeline_map(m_output.movie.get(),
+                                            m_output.track.id(), edit);
+    }
+}
+
+/*
+ * Chapters are written as both Nero style chapter list and QuickTime
+ * chapter track, or in the styles of the input when copied verbatim.
+ * L-SMASH only accepts chapters by file, therefore we write them into a
+ * temporary chapter file (see create_temporary()), with timestamps in
+ * nanoseconds (the finest L-SMASH reads).
+ */
+void M4ATrimmer::write_chapters()
+{
+    if (!m_output.chapters.size())
+        return;
+    std::string path;
+    FILE *fp = create_temporary(".chapters.txt", &path);
+    for (auto c = m_output.chapters.begin(); c != m_output.chapters.end(); ++c)
+    {
+        uint64_t ns = static_cast<uint64_t>(c->first * 1e9 + .5);
+        uint64_t secs = ns / 1000000000;
+        std::fprintf(fp, "%02u:%02u:%02u.%09u %s\n",
+                     unsigned(secs / 3600), unsigned(secs / 60 % 60),
+                     unsigned(secs % 60), unsigned(ns % 1000000000),
+                     c->second.c_str());
+    }
+    std::fclose(fp);
+    lsmash_root_t *mov = m_output.movie.get();
+    char *name = const_cast<char*>(path.c_str());
+    bool nero = !m_output.verbatim || m_input.has_nero_chapters;
+    bool qt = !m_output.verbatim || m_input.has_qt_chapters;
+    int nero_rc = nero ? lsmash_set_tyrant_chapter(mov, name, 0) : 0;
+    int qt_rc = qt ? lsmash_create_reference_chapter_track(mov,
+                                                           m_output.track.id(),
+                                                           name)
+                   : 0;
+    aa_unlink(path.c_str());
+    DieIF(nero_rc < 0 || qt_rc < 0);
+}
+
+void M4ATrimmer::remove_tag(lsmash_itunes_metadata_item fcc)
+{
+    for (auto e = m_tags.begin(); e != m_tags.end();) {
+        if (e->first.first == fcc)
+            m_tags.erase(e++);
+        else
+            ++e;
+    }
+    if (!m_input.metadata)
+        return;
+    const TagMap &items = m_input.metadata->items;
+    for (auto e = items.begin(); e != items.end(); ++e)
+        if (e->first.first == fcc)
+            m_removed_tags.insert(e->first);
+}
+
+void M4ATrimmer::reset_tags()
+{
+    m_tags.clear();
+    m_removed_tags.clear();
+    m_pool.clear();
+}
+
+void M4ATrimmer::get_itunes_metadata(
+        std::vector<lsmash_itunes_metadata_t> *items) const
+{
+    std::vector<lsmash_itunes_metadata_t> result;
+    auto t = m_tags.begin();
+    if (m_input.metadata) {
+        const TagMap &input = m_input.metadata->items;
+        for (auto e = input.begin(); e != input.end(); ++e) {
+            for (; t != m_tags.end() && t->first < e->first; ++t)
+                result.push_back(t->second);
+            if (t != m_tags.end() && t->first == e->first)
+                result.push_back((t++)->second);
+            else if (!m_removed_tags.count(e->first))
+                result.push_back(e->second);
+        }
+    }
+    for (; t != m_tags.end(); ++t)
+        result.push_back(t->second);
+    items->swap(result);
+}
+
 uint32_t M4ATrimmer::find_aac_track()
 {
     uint32_t track_id;
@@ -315,9 +673,9 @@ void M4ATrimmer::fetch_track_info(Track *t, uint32_t track_id)
         uint8_t *data;
         uint32_t size;
         lsmash_get_mp4sys_decoder_specific_info(p, &data, &size);
-        std::vector<uint8_t> cookie(data, data + size);
+        t->asc.assign(data, data + size);
         lsmash_free(data);
-        parse_ASC(cookie.data(), size, &t->aot, &t->sample_rate);
+        parse_ASC(t->asc.data(), size, &t->aot, &t->sample_rate);
         t->frames_per_packet = (t->aot == 2) ? 1024 : 2048;
         break;
     }
@@ -356,9 +714,6 @@ bool M4ATrimmer::parse_iTunSMPB(const lsmash_itunes_metadata_t &item)
     } else
         return true;
 
-    if (m_input.track.edits.count())
-        return true;
-
     std::stringstream ss(std::string(s, len));
     uint32_t junk, priming, padding;
     uint64_t duration;
@@ -367,7 +722,13 @@ bool M4ATrimmer::parse_iTunSMPB(const lsmash_itunes_metadata_t &item)
            >> std::hex >> padding
            >> std::hex >> duration)
     {
-        m_input.track.edits.add_entry(priming, duration);
+        m_input.has_iTunSMPB  = true;
+        m_input.smpb_priming  = priming;
+        m_input.smpb_padding  = padding;
+        m_input.smpb_duration = duration;
+        /* edit list takes precedence */
+        if (!m_input.track.edits.count())
+            m_input.track.edits.add_entry(priming, duration);
     }
     return true;
 }
@@ -375,25 +736,37 @@ bool M4ATrimmer::parse_iTunSMPB(const lsmash_itunes_metadata_t &item)
 void M4ATrimmer::populate_itunes_metadata(const lsmash_itunes_metadata_t &item)
 {
     lsmash_itunes_metadata_t res = item;
+    copy_itunes_metadata(&m_pool, &res);
+    TagKey k = tag_key(res);
+    m_tags[k] = res;
+    m_removed_tags.erase(k);
+    compact_itunes_metadata();
+}
 
-    if (item.meaning)
-        res.meaning = const_cast<char*>(m_pool.append(res.meaning));
-    if (item.name)
-        res.name = const_cast<char*>(m_pool.append(res.name));
-
-    if (item.type == ITUNES_METADATA_TYPE_STRING)
-        res.value.string = 
-            const_cast<char*>(m_pool.append(res.value.string));
-    else if (item.type == ITUNES_METADATA_TYPE_BINARY) {
-        res.value.binary = res.value.binary;
-        const char *d = reinterpret_cast<char*>(res.value.binary.data);
-        d  = m_pool.append(d, res.value.binary.size);
-        res.value.binary.data =
-            reinterpret_cast<uint8_t*>(const_cast<char*>(d));
+/*
+ * strings of overwritten tags (such as title and track number set for
+ * each chapter) are left in the pool. when they dominate, live ones are
+ * moved into the spare pool, which is swapped in, so that the pool
+ * stays bounded and blocks of both are reused.
+ */
+void M4ATrimmer::compact_itunes_metadata()
+{
+    size_t live = 0;
+    for (auto e = m_tags.begin(); e != m_tags.end(); ++e) {
+        const lsmash_itunes_metadata_t &item = e->second;
+        if (item.meaning) live += std::strlen(item.meaning) + 1;
+        if (item.name)    live += std::strlen(item.name) + 1;
+        if (item.type == ITUNES_METADATA_TYPE_STRING)
+            live += std::strlen(item.value.string) + 1;
+        else if (item.type == ITUNES_METADATA_TYPE_BINARY)
+            live += item.value.binary.size + 1;
     }
-    auto k = std::make_pair(res.item,
-                            res.name ? std::string(res.name) : std::string());
-    m_itunes_metadata[k] = res;
+    if (m_pool.size() <= live * 2 + 64 * 1024)
+        return;
+    m_spare_pool.clear();
+    for (auto e = m_tags.begin(); e != m_tags.end(); ++e)
+        copy_itunes_metadata(&m_spare_pool, &e->second);
+    m_pool.swap(m_spare_pool);
 }
 
 uint32_t M4ATrimmer::find_chapter_track()
@@ -456,8 +829,14 @@ void M4ATrimmer::add_audio_track()
     lsmash_root_t *mov = m_output.movie.get();
     m_output.track.track_params = m_input.track.track_params;
     m_output.track.media_params = m_input.track.media_params;
+    PayloadStats stats = payload_stats();
 #if HAVE_COMPACT_SAMPLE_SIZE_TABLE
-    m_output.track.media_params.compact_sample_size_table = 0;
+    /*
+     * stz2 can hold sample sizes up to 16 bits. L-SMASH picks the field
+     * size by itself, and co64 is chosen by L-SMASH when needed.
+     */
+    m_output.track.media_params.compact_sample_size_table =
+        m_layout.compact_tables && stats.max_au_size < 0x10000;
 #endif
 
     uint32_t trakid;
@@ -470,7 +849,32 @@ void M4ATrimmer::add_audio_track()
     m_output.track.media_params.timescale = m_input.track.timescale();
     DieIF(lsmash_set_media_parameters(mov, trakid,
                                       &m_output.track.media_params));
-    DieIF(!lsmash_add_sample_entry(mov, trakid, m_input.track.summary.get()));
+
+    /*
+     * bitrates in esds of the input are not valid for the output.
+     * patch the decoder config of the input summary while adding the
+     * sample entry (L-SMASH copies it), then restore.
+     */
+    std::lock_guard<std::mutex> lock(*m_input.lock);
+    lsmash_summary_t *summary = m_input.track.summary.get();
+    lsmash_mp4sys_decoder_parameters_t *dp = 0;
+    uint32_t ncs = lsmash_count_codec_specific_data(summary);
+    for (uint32_t i = 1; i <= ncs && !dp; ++i) {
+        auto c = lsmash_get_codec_specific_data(summary, i);
+        if (c->type == LSMASH_CODEC_SPECIFIC_DATA_TYPE_MP4SYS_DECODER_CONFIG)
+            dp = static_cast<lsmash_mp4sys_decoder_parameters_t*>(
+                    c->data.structured);
+    }
+    lsmash_mp4sys_decoder_parameters_t saved;
+    if (dp) {
+        saved = *dp;
+        dp->bufferSizeDB = stats.max_au_size;
+        dp->maxBitrate   = stats.max_bitrate;
+        dp->avgBitrate   = stats.avg_bitrate;
+    }
+    uint32_t index = lsmash_add_sample_entry(mov, trakid, summary);
+    if (dp) *dp = saved;
+    DieIF(!index);
 }
 
 void M4ATrimmer::set_text_tag(lsmash_itunes_metadata_item fcc,
@@ -543,23 +947,236 @@ void M4ATrimmer::set_disk_tag(unsigned index, unsigned total)
     populate_itunes_metadata(tag);
 }
 
-void M4ATrimmer::set_iTunSMPB()
+void M4ATrimmer::set_tag(const std::string &k, const std::string &v)
+{
+    struct tag_item {
+        const char                 *name;
+        lsmash_itunes_metadata_item fcc;
+    } tag_items[] = {
+        { "ALBUM",          ITUNES_METADATA_ITEM_ALBUM_NAME   },
+        { "ALBUMARTIST",    ITUNES_METADATA_ITEM_ALBUM_ARTIST },
+        { "ARTIST",         ITUNES_METADATA_ITEM_ARTIST       },
+        { "DATE",           ITUNES_METADATA_ITEM_RELEASE_DATE },
+        { "DISC",           ITUNES_METADATA_ITEM_DISC_NUMBER  },
+        { "GENRE",          ITUNES_METADATA_ITEM_USER_GENRE   },
+        { "SONGWRITER",     ITUNES_METADATA_ITEM_COMPOSER     },
+        { "TITLE",          ITUNES_METADATA_ITEM_TITLE        },
+        { "TRACK",          ITUNES_METADATA_ITEM_TRACK_NUMBER },
+        { 0,                ITUNES_METADATA_ITEM_CUSTOM       }
+    };
+
+    lsmash_itunes_metadata_item fcc = ITUNES_METADATA_ITEM_CUSTOM;
+    for (tag_item *p = tag_items; p->name; ++p) {
+        if (k == p->name) {
+            fcc = p->fcc;
+            break;
+        }
+    }
+    switch (fcc) {
+    case ITUNES_METADATA_ITEM_ALBUM_NAME:
+    case ITUNES_METADATA_ITEM_ALBUM_ARTIST:
+    case ITUNES_METADATA_ITEM_ARTIST:
+    case ITUNES_METADATA_ITEM_RELEASE_DATE:
+    case ITUNES_METADATA_ITEM_USER_GENRE:
+    case ITUNES_METADATA_ITEM_COMPOSER:
+    case ITUNES_METADATA_ITEM_TITLE:
+        set_text_tag(fcc, v);
+        break;
+    case ITUNES_METADATA_ITEM_DISC_NUMBER:
+        {
+            unsigned n, t = 0;
+            if (std::sscanf(v.c_str(), "%u/%u", &n, &t) > 0)
+                set_disk_tag(n, t);
+        }
+        break;
+    case ITUNES_METADATA_ITEM_TRACK_NUMBER:
+        {
+            unsigned n, t = 0;
+            if (std::sscanf(v.c_str(), "%u/%u", &n, &t) > 0)
+                set_track_tag(n, t);
+        }
+        break;
+    default: break;
+    }
+}
+
+void M4ATrimmer::calc_iTunSMPB(uint64_t num_au, uint32_t *priming,
+                              uint32_t *padding, uint64_t *duration) const
+{
+    uint64_t total_duration = num_au * m_input.track.access_unit_size();
+    *priming  = m_output.track.edits.offset(0);
+    *duration = m_output.track.edits.duration(0); 
+    int64_t pad = total_duration - *priming - *duration;
+    if (pad < 0) {
+        *duration += pad;
+        pad = 0;
+    }
+    *padding = pad;
+}
+
+/*
+ * iTunSMPB of the output, formatted into buf (256 bytes).
+ * not kept in the tags, so that it won't survive to the next output.
+ * the one of the input is used as it is when the values are the same.
+ */
+lsmash_itunes_metadata_t M4ATrimmer::iTunSMPB_tag(char *buf) const
 {
     const char *fmt = " 00000000 %08X %08X %08X%08X 00000000 00000000 "
         "00000000 00000000 00000000 00000000 00000000 00000000";
-    char buf[256];
 
-    uint64_t total_duration =
-        uint64_t(m_current_au - m_cut_start) * m_input.track.access_unit_size();
-    unsigned offset   = m_output.track.edits.offset(0);
-    uint64_t duration = m_output.track.edits.duration(0); 
-    int32_t padding = total_duration - offset - duration;
-    if (padding < 0) {
-        padding = 0;
-        duration += padding;
+    uint32_t priming, padding;
+    uint64_t duration;
+    calc_iTunSMPB(m_output_au, &priming, &padding, &duration);
+    if (m_input.has_iTunSMPB && priming == m_input.smpb_priming
+        && padding == m_input.smpb_padding
+        && duration == m_input.smpb_duration)
+        return m_input.metadata->iTunSMPB;
+    std::sprintf(buf, fmt, priming, padding, unsigned(duration >> 32),
+                 unsigned(duration & 0xffffffff));
+
+    lsmash_itunes_metadata_t tag;
+    memset(&tag, 0, sizeof tag);
+    tag.item         = ITUNES_METADATA_ITEM_CUSTOM;
+    tag.type         = ITUNES_METADATA_TYPE_STRING;
+    tag.meaning      = const_cast<char *>("com.apple.iTunes");
+    tag.name         = const_cast<char *>("iTunSMPB");
+    tag.value.string = buf;
+    return tag;
+}
+
+PayloadStats M4ATrimmer::payload_stats() const
+{
+    PayloadStats stats = {};
+    uint32_t au_size = m_input.track.access_unit_size();
+    /* number of AUs in 1 sec. window */
+    size_t window_au = std::max(1U, timescale() / au_size);
+    std::vector<uint32_t> window(window_au);
+    uint64_t window_bytes = 0, max_window_bytes = 0, num_au = 0;
+
+    for (auto r = m_cut_ranges.begin(); r != m_cut_ranges.end(); ++r) {
+        const Input &input = source(r->input);
+        std::lock_guard<std::mutex> lock(*input.lock);
+        for (uint64_t au = r->begin; au < r->end; ++au, ++num_au) {
+            lsmash_sample_t sample;
+            if (lsmash_get_sample_info_from_media_timeline(input.movie.get(),
+                                                           input.track.id(),
+                                                           au + 1, &sample))
+                break;
+            stats.size += sample.length;
+            if (sample.length > stats.max_au_size)
+                stats.max_au_size = sample.length;
+            uint32_t &slot = window[num_au % window_au];
+            window_bytes += sample.length;
+            window_bytes -= slot;
+            slot = sample.length;
+            if (window_bytes > max_window_bytes)
+                max_window_bytes = window_bytes;
+        }
+    }
+    if (num_au) {
+        double seconds = double(num_au) * au_size / timescale();
+        double window_seconds = double(window_au) * au_size / timescale();
+        stats.avg_bitrate = uint32_t(stats.size * 8 / seconds + .5);
+        stats.max_bitrate = uint32_t(max_window_bytes * 8 / window_seconds
+                                     + .5);
+        /* shorter than the window */
+        if (stats.max_bitrate < stats.avg_bitrate)
+            stats.max_bitrate = stats.avg_bitrate;
     }
-    std::sprintf(buf, fmt, offset, padding, int(duration >> 32),
-                 int(duration & 0xffffffff));
-    set_custom_tag("iTunSMPB", buf);
+    return stats;
 }
 
+uint64_t M4ATrimmer::estimate_file_size(uint64_t payload_size) const
+{
+    uint64_t num_au = num_access_units();
+    double seconds = double(num_au) * m_input.track.frames_per_packet
+                   / m_input.track.sample_rate;
+    /* L-SMASH cuts chunks by 0.5 sec. by default */
+    double chunk_duration = m_layout.chunk_duration > 0.0 ?
+                            m_layout.chunk_duration : 0.5;
+    uint64_t num_chunks = uint64_t(seconds / chunk_duration) + 1;
+    if (m_layout.chunk_size > 0)
+        num_chunks = std::max(num_chunks,
+                              payload_size / m_layout.chunk_size + 1);
+    /* assume 16 bit stz2 when compact table is enabled */
+    unsigned sample_size_bytes = m_layout.compact_tables ? 2 : 4;
+
+    uint64_t size = 32                              /* ftyp */
+                  + 16                              /* mdat header */
+                  + 1024                            /* fixed part of moov */
+                  + 20 + sample_size_bytes * num_au /* stsz */
+                  + 16 + 4 * num_chunks             /* stco */
+                  + 40                              /* stts, stsc */
+                  + 36 + 12 * output_edits().count(); /* edts */
+    std::vector<lsmash_itunes_metadata_t> items;
+    get_itunes_metadata(&items);
+    if (output_edits().count() == 1)
+        size += 24 + 12 + 16 + 12 + 8 + 116;        /* iTunSMPB */
+    for (auto e = items.begin(); e != items.end(); ++e) {
+        const lsmash_itunes_metadata_t &item = *e;
+        size += 24;
+        if (item.meaning) size += 12 + std::strlen(item.meaning);
+        if (item.name)    size += 12 + std::strlen(item.name);
+        if (item.type == ITUNES_METADATA_TYPE_STRING)
+            size += std::strlen(item.value.string);
+        else if (item.type == ITUNES_METADATA_TYPE_BINARY)
+            size += item.value.binary.size;
+        else
+            size += 8;
+    }
+    for (auto c = m_output.chapters.begin(); c != m_output.chapters.end(); ++c)
+        size += 2 * c->second.size() + 32;
+    if (m_output.chapters.size())
+        size += 1024;                               /* chapter track */
+    return size + payload_size;
+}
+
+void M4ATrimmer::get_tags(std::map<std::string, std::string> *tags) const
+{
+    std::map<std::string, std::string> result;
+    std::vector<lsmash_itunes_metadata_t> items;
+    get_itunes_metadata(&items);
+    for (auto e = items.begin(); e != items.end(); ++e) {
+        const lsmash_itunes_metadata_t &item = *e;
+        std::string key;
+        if (item.item == ITUNES_METADATA_ITEM_CUSTOM) {
+            key = item.name ? item.name : "";
+            if (key == "iTunSMPB")
+                continue;
+        } else {
+            for (int i = 24; i >= 0; i -= 8) {
+                unsigned char c = (item.item >> i) & 0xff;
+                if (c == 0xa9)
+                    key += "\xc2\xa9"; /* (C) in UTF-8 */
+                else
+                    key.push_back(c);
+            }
+        }
+        char buf[64];
+        std::string value;
+        switch (item.type) {
+        case ITUNES_METADATA_TYPE_STRING:
+            value = item.value.string;
+            break;
+        case ITUNES_METADATA_TYPE_INTEGER:
+            std::sprintf(buf, "%llu", (unsigned long long)item.value.integer);
+            value = buf;
+            break;
+        case ITUNES_METADATA_TYPE_BOOLEAN:
+            value = item.value.boolean ? "1" : "0";
+            break;
+        case ITUNES_METADATA_TYPE_BINARY:
+            {
+                /* hashed, so that large binaries can be compared */
+                std::sprintf(buf, "binary:%u:", item.value.binary.size);
+                value = buf + fnv1a_hex(item.value.binary.data,
+                                        item.value.binary.size);
+            }
+            break;
+        default:
+            break;
+        }
+        result[key] = value;
+    }
+    tags->swap(result);
+}
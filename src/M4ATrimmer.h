@@ -12,6 +12,8 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <set>
+#include <mutex>
 #include <stdexcept>
 extern "C" {
 #define LSMASH_DEMUXER_ENABLED
@@ -28,31 +30,146 @@ struct TimeSpec {
     } value;
 };
 
-/* ad-hoc pool for storing metadata string */
+typedef std::pair<TimeSpec, TimeSpec> TimeRange;
+
+/* chunk layout of output */
+struct LayoutPolicy {
+    double   chunk_duration;  /* max duration of a chunk in sec. 0: default */
+    uint64_t chunk_size;      /* max size of a chunk in bytes. 0: default */
+    bool     compact_tables;  /* use stz2 when sample sizes allow */
+};
+
+/* statistics of access units in the selected range */
+struct PayloadStats {
+    uint64_t size;          /* total size in bytes */
+    uint32_t max_au_size;
+    uint32_t avg_bitrate;   /* in bits per second */
+    uint32_t max_bitrate;   /* peak bitrate over any 1 second window */
+};
+
+/*
+ * callbacks for writing output somewhere other than a file, in the same
+ * manner as lsmash_file_parameters_t.
+ * read and seek are needed as well, for moving moov in front of mdat.
+ */
+struct OutputIO {
+    void *opaque;
+    int (*read)(void *opaque, uint8_t *buf, int size);
+    int (*write)(void *opaque, uint8_t *buf, int size);
+    int64_t (*seek)(void *opaque, int64_t offset, int whence);
+};
+
+/*
+ * bump pointer arena for storing metadata strings and binaries.
+ * appended data never gets relocated, and is nul terminated.
+ * blocks are kept on clear(), and reused without allocation.
+ */
 class StringPool {
-    /* use list so that elements won't get relocated */
-    std::list<std::string> m_pool;
+    enum { BLOCK_SIZE = 4096 };
+    struct Block {
+        std::shared_ptr<char> data;
+        size_t capacity;
+    };
+    std::vector<Block> m_blocks;
+    size_t m_block;  /* current block */
+    size_t m_used;   /* bytes used in the current block */
+    size_t m_size;   /* bytes appended since clear() */
 public:
+    StringPool(): m_block(0), m_used(0), m_size(0) {}
     const char *append(const char *s)
     {
-        m_pool.push_back(s);
-        return m_pool.back().c_str();
+        return append(s, std::strlen(s));
     }
     const char *append(const char *s, size_t len)
     {
-        m_pool.push_back(std::string(s, len));
-        return m_pool.back().c_str();
+        char *p = allocate(len + 1);
+        std::memcpy(p, s, len);
+        p[len] = 0;
+        return p;
     }
+    /* forget everything appended so far */
+    void clear() { m_block = m_used = m_size = 0; }
+    size_t size() const { return m_size; }
+    void swap(StringPool &other)
+    {
+        m_blocks.swap(other.m_blocks);
+        std::swap(m_block, other.m_block);
+        std::swap(m_used, other.m_used);
+        std::swap(m_size, other.m_size);
+    }
+private:
+    char *allocate(size_t n)
+    {
+        m_size += n;
+        for (; m_block < m_blocks.size(); ++m_block, m_used = 0) {
+            Block &b = m_blocks[m_block];
+            if (b.capacity - m_used >= n) {
+                char *p = b.data.get() + m_used;
+                m_used += n;
+                return p;
+            }
+        }
+        Block b;
+        b.capacity = n > BLOCK_SIZE ? n : BLOCK_SIZE;
+        b.data = std::shared_ptr<char>(new char[b.capacity],
+                                       std::default_delete<char[]>());
+        m_blocks.push_back(b);
+        m_used = n;
+        return b.data.get();
+    }
+    StringPool(const StringPool &);
+    StringPool &operator=(const StringPool &);
 };
 
 class M4ATrimmer {
+public:
+    /* span of input access units to be copied into output */
+    struct CutRange {
+        size_t   input;  /* 0: first input, n: n-th joined input */
+        uint64_t begin;  /* in access unit, inclusive */
+        uint64_t end;    /* in access unit, exclusive */
+        uint64_t base;   /* position in output, in access unit */
+    };
+private:
+    typedef std::pair<lsmash_itunes_metadata_item, std::string> TagKey;
+    typedef std::map<TagKey, lsmash_itunes_metadata_t> TagMap;
+    /*
+     * tags read from the input. immutable once the input is opened,
+     * so that it can be shared by trimmers (and threads) without copy.
+     */
+    struct Metadata {
+        StringPool pool;
+        TagMap items;
+        /* iTunSMPB as it is. valid when Input::has_iTunSMPB */
+        lsmash_itunes_metadata_t iTunSMPB;
+    };
     struct FileParameters: lsmash_file_parameters_t {
+        bool is_file;
+
         FileParameters(const std::string &filename, int open_mode)
+            : is_file(true)
         {
             if (lsmash_open_file(filename.c_str(), open_mode, this) < 0)
                 throw_file_error(filename, "cannot open");
         }
-        ~FileParameters() { lsmash_close_file(this); }
+        /* for writing, with defaults of lsmash_open_file() */
+        explicit FileParameters(const OutputIO &io): is_file(false)
+        {
+            lsmash_file_parameters_t *p = this;
+            std::memset(p, 0, sizeof *p);
+            mode = LSMASH_FILE_MODE_WRITE | LSMASH_FILE_MODE_BOX
+                 | LSMASH_FILE_MODE_INITIALIZATION | LSMASH_FILE_MODE_MEDIA;
+            opaque              = io.opaque;
+            read                = io.read;
+            write               = io.write;
+            seek                = io.seek;
+            major_brand         = ISOM_BRAND_TYPE_MP42;
+            max_chunk_duration  = 0.5;
+            max_async_tolerance = 2.0;
+            max_chunk_size      = 4 * 1024 * 1024;
+            max_read_size       = 4 * 1024 * 1024;
+        }
+        ~FileParameters() { if (is_file) lsmash_close_file(this); }
     private:
         FileParameters(const FileParameters &);
         FileParameters &operator=(const FileParameters &);
@@ -61,6 +178,7 @@ class M4ATrimmer {
         lsmash_track_parameters_t track_params;
         lsmash_media_parameters_t media_params;
         std::shared_ptr<lsmash_summary_t> summary;
+        std::vector<uint8_t> asc;       /* AudioSpecificConfig */
         uint8_t aot;
         uint32_t sample_rate;
         uint32_t frames_per_packet;
@@ -100,11 +218,26 @@ class M4ATrimmer {
     struct Input {
         std::shared_ptr<lsmash_root_t> movie;
         std::shared_ptr<FileParameters> file_params;
+        /* serializes access to movie, which can be shared by trimmers */
+        std::shared_ptr<std::mutex> lock;
         lsmash_movie_parameters_t movie_params;
         Track track;
         std::vector<std::pair<double, std::string> > chapters;
+        /* styles of chapters in the file */
+        bool has_nero_chapters;
+        bool has_qt_chapters;
+        std::string filename;
+        std::string name;  /* used as chapter title when joined */
+        std::shared_ptr<const Metadata> metadata;
+        /* values of iTunSMPB tag in the file */
+        bool has_iTunSMPB;
+        uint32_t smpb_priming;
+        uint32_t smpb_padding;
+        uint64_t smpb_duration;
         
-        Input()
+        Input(): has_nero_chapters(false), has_qt_chapters(false),
+                 has_iTunSMPB(false), smpb_priming(0), smpb_padding(0),
+                 smpb_duration(0)
         {
             memset(&movie_params, 0, sizeof movie_params);
             memset(&file_params, 0, sizeof file_params);
@@ -113,58 +246,189 @@ class M4ATrimmer {
     struct Output {
         std::shared_ptr<lsmash_root_t> movie;
         std::shared_ptr<FileParameters> file_params;
+        std::string filename;
         uint32_t timescale;
         Track track;
+        std::vector<std::pair<double, std::string> > chapters;
+        /*
+         * whole of the input is selected (select_all()): chapters are
+         * written in the styles of the input, and iTunSMPB is written
+         * only when the input has one.
+         */
+        bool verbatim;
 
-        Output(): timescale(0)
+        Output(): timescale(0), verbatim(false)
         {
             memset(&file_params, 0, sizeof file_params);
         }
     };
     Input m_input;
+    std::vector<Input> m_joined;
     Output m_output;
+    /*
+     * tags of the output, as overrides of the input ones: tags set, and
+     * input tags removed. strings of m_tags are stored in m_pool
+     * (m_spare_pool is for compaction).
+     */
+    TagMap m_tags;
+    std::set<TagKey> m_removed_tags;
     StringPool m_pool;
-    std::map<std::pair<lsmash_itunes_metadata_item, std::string>,
-             lsmash_itunes_metadata_t> m_itunes_metadata;
+    StringPool m_spare_pool;
+    std::vector<CutRange> m_cut_ranges;
+    size_t   m_current_range;
     uint64_t m_current_au;
+    uint64_t m_output_au;  /* number of access units written so far */
     uint64_t m_cut_start;  /* in access unit, inclusive */
     uint64_t m_cut_end;    /* in access unit, exclusive */
+    LayoutPolicy m_layout;
 public:
-    M4ATrimmer() : m_current_au(0), m_cut_start(0), m_cut_end(0)
+    M4ATrimmer() : m_current_range(0), m_current_au(0), m_output_au(0),
+                   m_cut_start(0), m_cut_end(0)
     {
+        std::memset(&m_layout, 0, sizeof m_layout);
     }
     void open_input(const std::string &filename);
+    /*
+     * share the input already opened by source, instead of parsing the
+     * file again. tags of the input are shared as well (tags set on
+     * source are not inherited), and source can be used concurrently by
+     * other trimmers.
+     */
+    void open_input(const M4ATrimmer &source);
+    /* rough estimation of memory held by the parsed input, in bytes */
+    size_t input_memory_usage() const;
+    /*
+     * open another input to be appended after the current one(s).
+     * the input must have identical AudioSpecificConfig.
+     */
+    void append_input(const std::string &filename);
     void open_output(const std::string &filename);
+    /*
+     * open output written through io.
+     * name is used in messages, and as the base of temporary files.
+     */
+    void open_output(const std::string &name, const OutputIO &io);
+    /* release the output, which has been finished or abandoned */
+    void close_output()
+    {
+        m_output.movie.reset();
+        m_output.file_params.reset();
+    }
     const std::vector<std::pair<double, std::string> > &chapters() const
     {
         return m_input.chapters;
     }
     void select_cut_point(const TimeSpec &startspec, const TimeSpec &endspec);
+    /*
+     * select multiple ranges to be kept in a single output.
+     * ranges must be in ascending order, and must not overlap.
+     */
+    void select_cut_ranges(const std::vector<TimeRange> &ranges);
     void select_chapter(unsigned nth);
+    /*
+     * select whole of each input in order, keeping gapless trim of each.
+     * chapters of the inputs are concatenated and written into output.
+     */
+    void select_joined_inputs();
+    /*
+     * select whole of the input as is, for remuxing.
+     * every access unit, edits and chapters are kept.
+     */
+    void select_all();
+    /* applied on open_output() */
+    void set_layout_policy(const LayoutPolicy &policy) { m_layout = policy; }
+    const LayoutPolicy &layout_policy() const { return m_layout; }
+    const std::vector<CutRange> &cut_ranges() const { return m_cut_ranges; }
+    uint64_t cut_start() const { return m_cut_start; }
+    uint64_t cut_end() const { return m_cut_end; }
+    const MP4Edits &output_edits() const { return m_output.track.edits; }
+    const std::string &input_filename(size_t n) const
+    {
+        return source(n).filename;
+    }
+    /*
+     * values of iTunSMPB to be written for the selected range.
+     * returns false when iTunSMPB is not written (multiple edits).
+     */
+    bool get_iTunSMPB(uint32_t *priming, uint32_t *padding,
+                      uint64_t *duration) const
+    {
+        if (m_output.track.edits.count() != 1)
+            return false;
+        calc_iTunSMPB(num_access_units(), priming, padding, duration);
+        return true;
+    }
+    /*
+     * sizes and bitrates of access units in the selected range.
+     * only sample table is looked up, and media data is not read.
+     */
+    PayloadStats payload_stats() const;
+    /* rough estimation of output file size */
+    uint64_t estimate_file_size(uint64_t payload_size) const;
+    /*
+     * tags to be written, in human readable form.
+     * keys are fourcc of the item, or name of the custom item.
+     */
+    void get_tags(std::map<std::string, std::string> *tags) const;
     uint64_t num_access_units() const
     {
-        return m_cut_end - m_cut_start;
+        uint64_t n = 0;
+        for (auto r = m_cut_ranges.begin(); r != m_cut_ranges.end(); ++r)
+            n += r->end - r->begin;
+        return n;
     }
     uint32_t timescale() const
     {
         return m_input.track.timescale();
     }
+    uint32_t sample_rate() const
+    {
+        return m_input.track.sample_rate;
+    }
     uint64_t duration() const
     {
         return m_input.track.duration();
     }
+    /* audio object type, as in AudioSpecificConfig (5/29 for SBR/PS) */
+    uint8_t aot() const { return m_input.track.aot; }
+    uint32_t frames_per_packet() const
+    {
+        return m_input.track.frames_per_packet;
+    }
+    /* edits of the input, or the ones derived from iTunSMPB */
+    const MP4Edits &input_edits() const { return m_input.track.edits; }
+    /* values of iTunSMPB tag in the input. false when not present */
+    bool get_input_iTunSMPB(uint32_t *priming, uint32_t *padding,
+                            uint64_t *duration) const
+    {
+        if (!m_input.has_iTunSMPB)
+            return false;
+        *priming  = m_input.smpb_priming;
+        *padding  = m_input.smpb_padding;
+        *duration = m_input.smpb_duration;
+        return true;
+    }
     bool copy_next_access_unit();
     void finish_write(lsmash_adhoc_remux_callback cb, void *cookie);
     void shift_edits(int64_t offset)
     {
         Track &t = m_input.track;
         t.edits.shift(offset, t.media_params.duration);
+        for (auto i = m_joined.begin(); i != m_joined.end(); ++i)
+            i->track.edits.shift(offset, i->track.media_params.duration);
     }
     void set_text_tag(lsmash_itunes_metadata_item fcc, const std::string &s);
     void set_custom_tag(const std::string &name, const std::string &value);
     void set_int_tag(lsmash_itunes_metadata_item fcc, uint64_t value);
     void set_track_tag(unsigned index, unsigned total);
     void set_disk_tag(unsigned index, unsigned total);
+    /* discard tags set or removed so far, back to the ones of the input */
+    void reset_tags();
+    /*
+     * set tag by name as in cuesheet (ALBUM, ARTIST, TITLE, TRACK...).
+     * unknown names are ignored.
+     */
+    void set_tag(const std::string &name, const std::string &value);
 private:
     std::shared_ptr<lsmash_root_t> new_movie()
     {
@@ -172,21 +436,43 @@ private:
         DieIF((root = lsmash_create_root()) == 0);
         return std::shared_ptr<lsmash_root_t>(root, lsmash_destroy_root);
     }
+    const Input &source(size_t n) const
+    {
+        return n ? m_joined[n - 1] : m_input;
+    }
+    int64_t to_media_time(const TimeSpec &spec);
+    void clear_cut_ranges();
+    void add_cut_edits(size_t input, const MP4Edits &edits);
+    void rewind();
+    void write_edits();
+    void write_chapters();
+    void remove_tag(lsmash_itunes_metadata_item fcc);
     uint32_t find_aac_track();
     void fetch_track_info(Track *t, uint32_t track_id);
     bool parse_iTunSMPB(const lsmash_itunes_metadata_t &item);
     void populate_itunes_metadata(const lsmash_itunes_metadata_t &item);
+    void compact_itunes_metadata();
+    /* tags of the output: tags of the input merged with the overrides */
+    void get_itunes_metadata(std::vector<lsmash_itunes_metadata_t> *items)
+        const;
     void fetch_chapters()
     {
         uint32_t track_id = find_chapter_track();
+        double ss;
+        m_input.has_qt_chapters = track_id != 0;
+        m_input.has_nero_chapters =
+            lsmash_get_tyrant_chapter(m_input.movie.get(), 1, &ss) != 0;
         if (track_id) fetch_qt_chapters(track_id);
         else fetch_nero_chapters();
     }
     uint32_t find_chapter_track();
     void fetch_qt_chapters(uint32_t trakid);
     void fetch_nero_chapters();
+    void setup_output();
     void add_audio_track();
-    void set_iTunSMPB();
+    void calc_iTunSMPB(uint64_t num_au, uint32_t *priming, uint32_t *padding,
+                       uint64_t *duration) const;
+    lsmash_itunes_metadata_t iTunSMPB_tag(char *buf) const;
 };
 
 #endif
@@ -7,37 +7,44 @@
 # include "config.h"
 #endif
 #include "MP4Edits.h"
+#include <algorithm>
 #include <limits>
-#include <numeric>
 
-uint64_t MP4Edits::total_duration() const
+unsigned MP4Edits::edit_for_position(int64_t position, int64_t *offset) const
 {
-    return std::accumulate(m_edits.begin(), m_edits.end(), 0ULL,
-                           [](uint64_t n, const entry_t &e) -> uint64_t {
-                                return n + e.second;
-                           });
+    size_t i = std::upper_bound(m_ends.begin(), m_ends.end(), position)
+             - m_ends.begin();
+    if (i == m_ends.size() && i > 0)
+        --i;
+    if (offset) *offset = position - start_position(i);
+    return i;
 }
 
-unsigned MP4Edits::edit_for_position(int64_t position, int64_t *offset) const
+void MP4Edits::media_offsets_for_positions(
+        const std::vector<int64_t> &positions,
+        std::vector<int64_t> *offsets) const
 {
-    int64_t acc = 0;
-    int64_t off = 0;
-    size_t  i = 0;
-    for (; i < m_edits.size(); ++i) {
-        off =  position - acc;
-        acc += m_edits[i].second;
-        if (position < acc)
-            break;
+    offsets->resize(positions.size());
+    size_t hint = 0;
+    for (size_t k = 0; k < positions.size(); ++k) {
+        int64_t position = positions[k];
+        if (hint && position < start_position(hint))
+            hint = 0;
+        size_t i = std::upper_bound(m_ends.begin() + hint, m_ends.end(),
+                                    position) - m_ends.begin();
+        if (i == m_ends.size() && i > 0)
+            --i;
+        (*offsets)[k] = offset(i) + position - start_position(i);
+        hint = i;
     }
-    if (offset) *offset = off;
-    return i == m_edits.size() ? i - 1 : i;
 }
 
+/* entries are compacted in place */
 void MP4Edits::shift(int64_t offset, int64_t bound)
 {
-    std::vector<entry_t> new_edits;
-    for (auto e = m_edits.begin(); e != m_edits.end(); ++e) {
-        entry_t edit = *e;
+    size_t n = 0;
+    for (size_t i = 0; i < m_edits.size(); ++i) {
+        entry_t edit = m_edits[i];
         if (edit.first >= 0) {
             edit.first = edit.first + offset;
             if (edit.first < 0) {
@@ -48,31 +55,32 @@ void MP4Edits::shift(int64_t offset, int64_t bound)
                 edit.second = bound - edit.first;
         }
         if (edit.second > 0)
-            new_edits.push_back(edit);
+            m_edits[n++] = edit;
     }
-    m_edits.swap(new_edits);
+    m_edits.resize(n);
+    update_ends();
 }
 
 void MP4Edits::crop(int64_t start, int64_t end)
+{
+    std::pair<size_t, size_t> range = find_window(start, end);
+    size_t n = 0;
+    for (size_t i = range.first; i < range.second; ++i)
+        m_edits[n++] = crop_entry(i, start, end);
+    m_edits.resize(n);
+    update_ends();
+}
+
+void MP4Edits::crop(const std::vector<std::pair<int64_t, int64_t> > &windows)
 {
     std::vector<entry_t> new_edits;
-    int64_t acc = 0;
-    for (auto e = m_edits.begin(); e != m_edits.end(); ++e) {
-        if (acc < end && acc + e->second > start) {
-            entry_t edit = *e;
-            if (acc < start) {
-                int64_t trim = start - acc;
-                if (edit.first >= 0)
-                    edit.first  += trim;
-                edit.second -= trim;
-            }
-            if (acc + e->second > end)
-                edit.second -= acc + e->second - end;
-            new_edits.push_back(edit);
-        }
-        acc += e->second;
+    for (auto w = windows.begin(); w != windows.end(); ++w) {
+        std::pair<size_t, size_t> range = find_window(w->first, w->second);
+        for (size_t i = range.first; i < range.second; ++i)
+            new_edits.push_back(crop_entry(i, w->first, w->second));
     }
     m_edits.swap(new_edits);
+    update_ends();
 }
 
 int64_t MP4Edits::minimum_media_position()
@@ -93,3 +101,39 @@ int64_t MP4Edits::maximum_media_position()
             candidate = e->first + e->second;
     return candidate;
 }
+
+std::pair<size_t, size_t> MP4Edits::find_window(int64_t start,
+                                                int64_t end) const
+{
+    /* first edit ending after start, and the one containing end */
+    size_t first = std::upper_bound(m_ends.begin(), m_ends.end(), start)
+                 - m_ends.begin();
+    size_t last = std::lower_bound(m_ends.begin(), m_ends.end(), end)
+                - m_ends.begin();
+    last = std::min(last + 1, m_ends.size());
+    return std::make_pair(first, std::max(first, last));
+}
+
+MP4Edits::entry_t MP4Edits::crop_entry(size_t edit_index, int64_t start,
+                                       int64_t end) const
+{
+    entry_t edit = m_edits[edit_index];
+    int64_t edit_start = start_position(edit_index);
+    if (edit_start < start) {
+        int64_t trim = start - edit_start;
+        if (edit.first >= 0)
+            edit.first  += trim;
+        edit.second -= trim;
+    }
+    if (m_ends[edit_index] > end)
+        edit.second -= m_ends[edit_index] - end;
+    return edit;
+}
+
+void MP4Edits::update_ends()
+{
+    m_ends.resize(m_edits.size());
+    int64_t acc = 0;
+    for (size_t i = 0; i < m_edits.size(); ++i)
+        m_ends[i] = acc += m_edits[i].second;
+}
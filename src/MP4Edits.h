@@ -10,16 +10,26 @@
 #include <utility>
 #include <vector>
 
+/*
+ * edit list, as pairs of media offset and duration.
+ * end position (on presentation timeline) of each edit is kept as prefix
+ * sum of durations, so that positions are looked up by binary search.
+ */
 class MP4Edits {
     typedef std::pair<int64_t, int64_t> entry_t;
     std::vector<entry_t> m_edits;
+    std::vector<int64_t> m_ends;  /* presentation end of each edit */
 public:
     void add_entry(int64_t offset, int64_t duration)
     {
         m_edits.push_back(std::make_pair(offset, duration));
+        m_ends.push_back(total_duration() + duration);
     }
     size_t count() const { return m_edits.size(); }
-    uint64_t total_duration() const;
+    uint64_t total_duration() const
+    {
+        return m_ends.size() ? m_ends.back() : 0;
+    }
     int64_t offset(unsigned edit_index) const
     {
         return m_edits[edit_index].first;
@@ -28,8 +38,14 @@ public:
     {
         return m_edits[edit_index].second;
     }
+    /* presentation position where the edit starts */
+    int64_t start_position(unsigned edit_index) const
+    {
+        return edit_index ? m_ends[edit_index - 1] : 0;
+    }
     /*
-     * get edit index which corresponds to given presentation position
+     * get edit index which corresponds to given presentation position.
+     * position beyond the end is mapped into the last edit.
      */
     unsigned edit_for_position(int64_t position, int64_t *offset=0) const;
     /*
@@ -41,6 +57,12 @@ public:
         unsigned edit = edit_for_position(position, &off);
         return offset(edit) + off;
     }
+    /*
+     * media_offset_for_position() for each of positions at once.
+     * positions in ascending order are looked up from the previous hit.
+     */
+    void media_offsets_for_positions(const std::vector<int64_t> &positions,
+                                     std::vector<int64_t> *offsets) const;
     /*
      * slide media position of each edit by the given offset.
      * when an edit window is slided to negative direction
@@ -53,8 +75,21 @@ public:
      * crop edits by given presentation positions
      */
     void crop(int64_t start, int64_t end);
+    /*
+     * crop edits by multiple presentation windows.
+     * windows are given as [start, end) pairs in ascending order, and
+     * must not overlap each other.
+     * resulting edits are concatenation of each cropped window.
+     */
+    void crop(const std::vector<std::pair<int64_t, int64_t> > &windows);
     int64_t minimum_media_position();
     int64_t maximum_media_position();
+private:
+    /* range of edits overlapping presentation window [start, end) */
+    std::pair<size_t, size_t> find_window(int64_t start, int64_t end) const;
+    /* the edit trimmed into presentation window [start, end) */
+    entry_t crop_entry(size_t edit_index, int64_t start, int64_t end) const;
+    void update_ends();
 };
 
 #endif
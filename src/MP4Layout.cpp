@@ -0,0 +1,241 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include "MP4Layout.h"
+#include "compat.h"
+#include "die.h"
+
+namespace {
+
+uint32_t get32(const uint8_t *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint64_t get64(const uint8_t *p)
+{
+    return (uint64_t(get32(p)) << 32) | get32(p + 4);
+}
+
+/*
+ * boxes of the file, read by headers and seeks, so that large boxes
+ * (moov in particular) are never loaded into memory.
+ */
+class BoxFile {
+    FILE *m_fp;
+public:
+    explicit BoxFile(FILE *fp): m_fp(fp) {}
+    /* false on short read */
+    bool read(uint64_t pos, void *buf, size_t size)
+    {
+        return aa_fseek(m_fp, pos, SEEK_SET) == 0
+            && std::fread(buf, 1, size, m_fp) == size;
+    }
+    /*
+     * iterate over child boxes in [begin, end).
+     * f(type, payload_pos, payload_size, box_size) is called for each box.
+     * returns false when stopped by a broken box.
+     */
+    template <typename F>
+    bool walk(uint64_t begin, uint64_t end, F f)
+    {
+        for (uint64_t pos = begin; end - pos >= 8; ) {
+            uint8_t hdr[16];
+            if (!read(pos, hdr, 8))
+                return false;
+            uint64_t size = get32(hdr);
+            std::string type(reinterpret_cast<char*>(hdr + 4), 4);
+            unsigned hdrsize = 8;
+            if (size == 1) {
+                if (end - pos < 16 || !read(pos + 8, hdr + 8, 8))
+                    return false;
+                size = get64(hdr + 8);
+                hdrsize = 16;
+            } else if (size == 0)
+                size = end - pos;
+            if (size < hdrsize || size > end - pos)
+                return false;
+            f(type, pos + hdrsize, size - hdrsize, size);
+            pos += size;
+        }
+        return true;
+    }
+};
+
+/* maximum of sample sizes in stsz, read in pieces */
+uint32_t scan_sample_sizes(BoxFile &file, uint64_t pos, uint64_t count)
+{
+    uint32_t max_size = 0;
+    std::vector<uint8_t> buf(64 * 1024);
+    while (count > 0) {
+        size_t n = std::min<uint64_t>(count, buf.size() / 4);
+        if (!file.read(pos, buf.data(), n * 4))
+            break;
+        for (size_t i = 0; i < n; ++i)
+            max_size = std::max(max_size, get32(&buf[i * 4]));
+        pos += n * 4;
+        count -= n;
+    }
+    return max_size;
+}
+
+void inspect_stbl(BoxFile &file, uint64_t pos, uint64_t size,
+                  bool scan_sizes, MP4Layout *layout)
+{
+    file.walk(pos, pos + size,
+              [&](const std::string &type, uint64_t data, uint64_t len,
+                  uint64_t) {
+        uint8_t buf[12];
+        if (type == "stsz" && len >= 12 && file.read(data, buf, 12)) {
+            layout->num_samples = get32(buf + 8);
+            layout->max_sample_size = get32(buf + 4);
+            if (layout->max_sample_size == 0 && scan_sizes) {
+                uint64_t n = std::min<uint64_t>(layout->num_samples,
+                                                (len - 12) / 4);
+                layout->max_sample_size =
+                    scan_sample_sizes(file, data + 12, n);
+            }
+        } else if (type == "stz2" && len >= 12 && file.read(data, buf, 12)) {
+            layout->num_samples = get32(buf + 8);
+            layout->compact_sample_size_table = true;
+        } else if ((type == "stco" || type == "co64") && len >= 8
+                   && file.read(data, buf, 8)) {
+            layout->num_chunks = get32(buf + 4);
+            layout->large_chunk_offset = (type == "co64");
+        }
+    });
+}
+
+/* handler type of the track, and position of mdia */
+std::string track_handler(BoxFile &file, uint64_t pos, uint64_t size,
+                          uint64_t *mdia, uint64_t *mdia_size)
+{
+    std::string handler;
+    *mdia = *mdia_size = 0;
+    file.walk(pos, pos + size,
+              [&](const std::string &type, uint64_t data, uint64_t len,
+                  uint64_t) {
+        if (type == "mdia") {
+            *mdia = data;
+            *mdia_size = len;
+        }
+    });
+    if (!*mdia)
+        return handler;
+    file.walk(*mdia, *mdia + *mdia_size,
+              [&](const std::string &type, uint64_t data, uint64_t len,
+                  uint64_t) {
+        uint8_t buf[12];
+        if (type == "hdlr" && len >= 12 && file.read(data, buf, 12))
+            handler.assign(reinterpret_cast<char*>(buf + 8), 4);
+    });
+    return handler;
+}
+
+void inspect_sound_track(BoxFile &file, uint64_t mdia, uint64_t mdia_size,
+                         bool scan_sizes, MP4Layout *layout)
+{
+    file.walk(mdia, mdia + mdia_size,
+              [&](const std::string &type, uint64_t data, uint64_t len,
+                  uint64_t) {
+        uint8_t buf[32];
+        if (type == "mdhd" && len >= 20
+            && file.read(data, buf, std::min<uint64_t>(len, 32))) {
+            if (buf[0] == 1 && len >= 32) {
+                layout->timescale = get32(buf + 20);
+                layout->duration  = get64(buf + 24);
+            } else {
+                layout->timescale = get32(buf + 12);
+                layout->duration  = get32(buf + 16);
+            }
+        } else if (type == "minf") {
+            file.walk(data, data + len,
+                      [&](const std::string &type, uint64_t data,
+                          uint64_t len, uint64_t) {
+                if (type == "stbl")
+                    inspect_stbl(file, data, len, scan_sizes, layout);
+            });
+        }
+    });
+}
+
+} // end of empty namespace
+
+void MP4Layout::inspect(const std::string &filename, bool scan_sample_sizes)
+{
+    FILE *fp = aa_fopen(filename.c_str(), "rb");
+    if (!fp)
+        throw_file_error(filename, std::strerror(errno));
+    std::shared_ptr<FILE> __fp__(fp, std::fclose);
+    aa_stat_t st;
+    if (aa_stat(filename.c_str(), &st) < 0)
+        throw_file_error(filename, std::strerror(errno));
+    file_size = st.size;
+
+    BoxFile file(fp);
+    uint64_t moov = 0, moov_len = 0;
+    bool seen_mdat = false;
+    bool ok = file.walk(0, file_size,
+                        [&](const std::string &type, uint64_t data,
+                            uint64_t len, uint64_t size) {
+        top_level_boxes.push_back(type);
+        if (type == "mdat")
+            seen_mdat = true;
+        if (type == "moov" && !moov_size) {
+            moov_first = !seen_mdat;
+            moov_size = size;
+            moov = data;
+            moov_len = len;
+        }
+    });
+    if (!ok)
+        throw_file_error(filename, "broken box structure");
+    if (!moov_size)
+        throw_file_error(filename, "moov not found");
+
+    bool found = false;
+    file.walk(moov, moov + moov_len,
+              [&](const std::string &type, uint64_t data, uint64_t len,
+                  uint64_t size) {
+        if (type == "udta" || type == "meta")
+            metadata_size += size;
+        else if (type == "trak") {
+            uint64_t mdia, mdia_size;
+            handlers.push_back(track_handler(file, data, len,
+                                             &mdia, &mdia_size));
+            if (handlers.back() == "soun" && !found) {
+                found = true;
+                inspect_sound_track(file, mdia, mdia_size,
+                                    scan_sample_sizes, this);
+            }
+        }
+    });
+}
+
+bool MP4Layout::is_optimal(double chunk_duration, bool compact_tables) const
+{
+    if (!moov_first)
+        return false;
+    if (compact_tables && !compact_sample_size_table
+        && max_sample_size < 0x10000)
+        return false;
+    if (large_chunk_offset && file_size <= 0xffffffff)
+        return false;
+    for (size_t i = 0; i < top_level_boxes.size(); ++i) {
+        const std::string &type = top_level_boxes[i];
+        if ((type == "free" || type == "skip")
+            && (i == 0 || top_level_boxes[i - 1] != "moov"))
+            return false;
+    }
+    return average_chunk_duration() >= chunk_duration / 2;
+}
@@ -0,0 +1,61 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef MP4Layout_H
+#define MP4Layout_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Physical layout of MP4 file, inspected by walking boxes without
+ * L-SMASH. Only headers of boxes are read.
+ * Only the first sound track is looked into.
+ */
+struct MP4Layout {
+    std::vector<std::string> top_level_boxes; /* type of each box in order */
+    bool     moov_first;       /* moov is placed before mdat */
+    uint64_t file_size;
+    uint64_t moov_size;
+    uint64_t metadata_size;    /* size of udta and meta in moov */
+    uint32_t timescale;        /* of the sound track */
+    uint64_t duration;         /* of the sound track, in timescale */
+    uint32_t num_samples;
+    uint32_t num_chunks;
+    uint32_t max_sample_size;  /* 0 when stz2 is used, or not scanned */
+    bool     compact_sample_size_table;  /* stz2 */
+    bool     large_chunk_offset;         /* co64 */
+    std::vector<std::string> handlers;  /* handler type of each track */
+
+    MP4Layout()
+        : moov_first(false), file_size(0), moov_size(0), metadata_size(0),
+          timescale(0), duration(0), num_samples(0), num_chunks(0),
+          max_sample_size(0), compact_sample_size_table(false),
+          large_chunk_offset(false)
+    {}
+    /*
+     * throws std::runtime_error on failure.
+     * entries of stsz are read (in pieces) only when scan_sample_sizes.
+     */
+    void inspect(const std::string &filename, bool scan_sample_sizes=false);
+    /* average duration of chunks in seconds */
+    double average_chunk_duration() const
+    {
+        if (!num_chunks || !timescale)
+            return 0.0;
+        return double(duration) / timescale / num_chunks;
+    }
+    /*
+     * true when moov is in front of mdat, and no padding box (free/skip)
+     * is there except for one just after moov (reserved for tag editing),
+     * and chunks are not shorter than the half of chunk_duration.
+     * stsz is not optimal when stz2 could be used (compact_tables), and
+     * co64 is not optimal when the file is smaller than 4GB.
+     * sample sizes have to be scanned by inspect().
+     */
+    bool is_optimal(double chunk_duration, bool compact_tables) const;
+};
+
+#endif
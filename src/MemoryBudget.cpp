@@ -0,0 +1,74 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <stdexcept>
+#include "MemoryBudget.h"
+#include "MP4Layout.h"
+
+void MemoryBudget::acquire(uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t ticket = m_next_ticket++;
+    m_cond.wait(lock, [&]() {
+        return ticket == m_serving
+            && (m_running == 0 || m_used + size <= m_limit);
+    });
+    ++m_serving;
+    ++m_running;
+    m_used += size;
+    /* next one in the queue might fit as well */
+    m_cond.notify_all();
+}
+
+void MemoryBudget::release(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    --m_running;
+    m_used -= size;
+    m_cond.notify_all();
+}
+
+namespace {
+
+/* base, and buffer for moving moov in front of mdat on finishing */
+const uint64_t BASE_SIZE = 64 * 1024 + 4 * 1024 * 1024;
+
+uint64_t input_size(const MP4Layout &layout)
+{
+    /*
+     * moov is read as a whole by L-SMASH, which builds sample tables and
+     * timeline of some hundred bytes per sample for input (see
+     * M4ATrimmer::input_memory_usage()), and sample tables for output.
+     * metadata is held by both of input and output.
+     */
+    return layout.moov_size + layout.num_samples * 192ULL
+         + layout.metadata_size * 2;
+}
+
+} // end of empty namespace
+
+/* only headers of boxes are read, not to load the input before admission */
+uint64_t MemoryBudget::estimate(const std::vector<std::string> &inputs)
+{
+    uint64_t size = BASE_SIZE;
+    for (auto i = inputs.begin(); i != inputs.end(); ++i) {
+        MP4Layout layout;
+        try {
+            layout.inspect(*i);
+        } catch (const std::runtime_error &) {
+            /* will fail on opening anyway */
+            continue;
+        }
+        size += input_size(layout);
+    }
+    return size;
+}
+
+uint64_t MemoryBudget::estimate(const MP4Layout &input)
+{
+    return BASE_SIZE + input_size(input);
+}
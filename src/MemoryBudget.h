@@ -0,0 +1,72 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef MemoryBudget_H
+#define MemoryBudget_H
+
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct MP4Layout;
+
+/*
+ * admission control of jobs by estimated peak memory usage.
+ * a job is admitted while the total of running jobs stays under the
+ * limit, so that the number of jobs running at once adapts to the size
+ * of them.
+ * jobs are admitted in the order of arrival, so that a large job is not
+ * starved by small ones. a job exceeding the limit by itself is admitted
+ * when no other job is running.
+ */
+class MemoryBudget {
+    uint64_t m_limit;
+    uint64_t m_used;
+    unsigned m_running;
+    uint64_t m_next_ticket;
+    uint64_t m_serving;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+public:
+    explicit MemoryBudget(uint64_t limit)
+        : m_limit(limit), m_used(0), m_running(0),
+          m_next_ticket(0), m_serving(0)
+    {}
+    /* block until the job of the size is admitted */
+    void acquire(uint64_t size);
+    void release(uint64_t size);
+    /*
+     * estimated peak memory usage of a job processing the inputs,
+     * from moov size, number of samples and size of metadata.
+     */
+    static uint64_t estimate(const std::vector<std::string> &inputs);
+    /* same as above, for an input already inspected */
+    static uint64_t estimate(const MP4Layout &input);
+private:
+    MemoryBudget(const MemoryBudget &);
+    MemoryBudget &operator=(const MemoryBudget &);
+};
+
+/* admission of a job for the scope. budget can be null */
+class MemoryGrant {
+    MemoryBudget *m_budget;
+    uint64_t m_size;
+public:
+    MemoryGrant(MemoryBudget *budget, uint64_t size)
+        : m_budget(budget), m_size(size)
+    {
+        if (m_budget) m_budget->acquire(m_size);
+    }
+    ~MemoryGrant()
+    {
+        if (m_budget) m_budget->release(m_size);
+    }
+private:
+    MemoryGrant(const MemoryGrant &);
+    MemoryGrant &operator=(const MemoryGrant &);
+};
+
+#endif
@@ -0,0 +1,193 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "OutputJournal.h"
+#include "compat.h"
+#include "die.h"
+#include "json.h"
+
+OutputJournal::OutputJournal(const std::string &filename,
+                             unsigned sync_interval)
+    : m_filename(filename),
+      m_sync_interval(sync_interval ? sync_interval : 1)
+{
+    load();
+}
+
+OutputJournal::~OutputJournal()
+{
+    try {
+        flush();
+    } catch (...) {}
+}
+
+bool OutputJournal::is_done(const std::string &output)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    aa_stat_t st;
+    return m_done.count(output) && aa_stat(output.c_str(), &st) == 0;
+}
+
+std::string OutputJournal::begin(const std::string &output)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    /* not synced; on crash of the OS, a temporary can be left behind */
+    append("begin", output);
+    if (std::fflush(m_fp.get()) != 0)
+        throw_file_error(m_filename, std::strerror(errno));
+    return temporary_name(output);
+}
+
+void OutputJournal::commit(const std::string &output)
+{
+    std::string tmpname = temporary_name(output);
+    if (aa_rename(tmpname.c_str(), output.c_str())) {
+        int err = errno;
+        aa_unlink(tmpname.c_str());
+        throw_file_error(output, std::strerror(err));
+    }
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(output);
+        full = m_pending.size() >= m_sync_interval;
+    }
+    if (full)
+        flush();
+}
+
+void OutputJournal::abort(const std::string &output)
+{
+    aa_unlink(temporary_name(output).c_str());
+}
+
+/*
+ * outputs are synced outside of the lock, so that workers can go on
+ * while the group is being flushed.
+ */
+void OutputJournal::flush()
+{
+    std::vector<std::string> outputs;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        outputs.swap(m_pending);
+    }
+    if (outputs.empty())
+        return;
+    sync_outputs(outputs);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto o = outputs.begin(); o != outputs.end(); ++o) {
+        append("done", *o);
+        m_done.insert(*o);
+    }
+    if (aa_fsync(m_fp.get()) != 0)
+        throw_file_error(m_filename, std::strerror(errno));
+}
+
+std::string OutputJournal::temporary_name(const std::string &output)
+{
+    return output + ".m4acut-part";
+}
+
+/*
+ * read the journal of previous run, remove temporaries left by it,
+ * and rewrite the journal with done entries only.
+ * malformed lines (truncated on crash) are ignored.
+ */
+void OutputJournal::load()
+{
+    std::set<std::string> begun;
+    FILE *fp = aa_fopen(m_filename.c_str(), "rb");
+    if (fp) {
+        std::shared_ptr<FILE> __fp__(fp, std::fclose);
+        std::string line;
+        int c;
+        while ((c = std::getc(fp)) != EOF) {
+            if (c != '\n') {
+                line.push_back(c);
+                continue;
+            }
+            try {
+                JSONValue entry = JSONValue::parse(line);
+                const JSONValue *v;
+                if ((v = entry.get("done")) && v->type() == JSONValue::STRING)
+                    m_done.insert(v->as_string());
+                else if ((v = entry.get("begin"))
+                         && v->type() == JSONValue::STRING)
+                    begun.insert(v->as_string());
+            } catch (const std::runtime_error &) {}
+            line.clear();
+        }
+    }
+    for (auto o = begun.begin(); o != begun.end(); ++o) {
+        if (m_done.count(*o))
+            continue;
+        std::string tmpname = temporary_name(*o);
+        if (aa_unlink(tmpname.c_str()) == 0)
+            aa_fprintf(stderr, "%s: removed incomplete output\n",
+                       tmpname.c_str());
+    }
+
+    std::string tmpname = m_filename + ".tmp";
+    fp = aa_fopen(tmpname.c_str(), "wb");
+    if (!fp)
+        throw_file_error(tmpname, std::strerror(errno));
+    m_fp.reset(fp, std::fclose);
+    for (auto o = m_done.begin(); o != m_done.end(); ++o)
+        append("done", *o);
+    if (aa_fsync(fp) != 0)
+        throw_file_error(tmpname, std::strerror(errno));
+    m_fp.reset();
+    if (aa_rename(tmpname.c_str(), m_filename.c_str()))
+        throw_file_error(m_filename, std::strerror(errno));
+    if (!(fp = aa_fopen(m_filename.c_str(), "ab")))
+        throw_file_error(m_filename, std::strerror(errno));
+    m_fp.reset(fp, std::fclose);
+}
+
+void OutputJournal::append(const char *key, const std::string &output)
+{
+    if (std::fprintf(m_fp.get(), "{\"%s\":%s}\n", key,
+                     json_quote(output).c_str()) < 0)
+        throw_file_error(m_filename, std::strerror(errno));
+}
+
+/*
+ * flush the outputs (and the renames of them) to the storage.
+ * one syncfs() for each directory is enough when available, otherwise
+ * each output and directory is synced.
+ */
+void OutputJournal::sync_outputs(const std::vector<std::string> &outputs)
+{
+    std::set<std::string> dirs;
+    for (auto o = outputs.begin(); o != outputs.end(); ++o) {
+        size_t pos = o->find_last_of("/\\");
+        dirs.insert(pos == std::string::npos ? "." : o->substr(0, pos + 1));
+    }
+    bool synced = true;
+    for (auto d = dirs.begin(); synced && d != dirs.end(); ++d) {
+        if (aa_syncfs(d->c_str()) == 0)
+            continue;
+        if (errno != ENOSYS)
+            throw_file_error(*d, std::strerror(errno));
+        synced = false;
+    }
+    if (synced)
+        return;
+    for (auto o = outputs.begin(); o != outputs.end(); ++o)
+        if (aa_sync_path(o->c_str()) != 0)
+            throw_file_error(*o, std::strerror(errno));
+    /* directories can't be synced on some platforms */
+    for (auto d = dirs.begin(); d != dirs.end(); ++d)
+        aa_sync_path(d->c_str());
+}
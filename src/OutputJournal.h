@@ -0,0 +1,58 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef OutputJournal_H
+#define OutputJournal_H
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Append-only journal of finished outputs, for resuming interrupted runs.
+ *
+ * An output is written into a temporary file (recorded by "begin" entry
+ * beforehand), renamed to the final name, and then recorded by "done"
+ * entry. Done entries are written in groups, after the outputs of the
+ * group are flushed to the storage, so that the journal never refers to
+ * an output which can be lost on crash.
+ *
+ * On open, temporaries of outputs begun but not done by the previous run
+ * are removed.
+ */
+class OutputJournal {
+    std::string m_filename;
+    std::shared_ptr<FILE> m_fp;
+    std::set<std::string> m_done;
+    std::vector<std::string> m_pending;  /* renamed, not yet in journal */
+    unsigned m_sync_interval;
+    std::mutex m_mutex;
+public:
+    /* sync_interval: number of outputs flushed to the storage at once */
+    OutputJournal(const std::string &filename, unsigned sync_interval);
+    ~OutputJournal();
+    /* true when the output is in the journal, and still exists */
+    bool is_done(const std::string &output);
+    /* record the output as begun, and return the temporary name for it */
+    std::string begin(const std::string &output);
+    /* rename the temporary to the output, and record it as done */
+    void commit(const std::string &output);
+    /* remove the temporary of failed output */
+    void abort(const std::string &output);
+    /* flush outputs committed so far, and write them into the journal */
+    void flush();
+private:
+    static std::string temporary_name(const std::string &output);
+    void load();
+    void append(const char *key, const std::string &output);
+    void sync_outputs(const std::vector<std::string> &outputs);
+
+    OutputJournal(const OutputJournal &);
+    OutputJournal &operator=(const OutputJournal &);
+};
+
+#endif
@@ -0,0 +1,131 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include "PlanManifest.h"
+#include "compat.h"
+#include "die.h"
+#include "json.h"
+
+namespace {
+    /* entries of the manifest on disk, keyed by output */
+    void load_manifest(const std::string &filename,
+                       std::map<std::string, std::string> *entries)
+    {
+        FILE *fp = aa_fopen(filename.c_str(), "rb");
+        if (!fp)
+            return;
+        std::shared_ptr<FILE> __fp__(fp, std::fclose);
+
+        std::string line;
+        int c;
+        while ((c = std::getc(fp)) != EOF) {
+            if (c != '\n') {
+                line.push_back(c);
+                continue;
+            }
+            if (line.size()) {
+                JSONValue plan = JSONValue::parse(line);
+                const JSONValue *output = plan.get("output");
+                if (!output || output->type() != JSONValue::STRING)
+                    throw_file_error(filename, "output missing in manifest");
+                (*entries)[output->as_string()] = line;
+            }
+            line.clear();
+        }
+    }
+
+    /*
+     * lock file to serialize saving by invocations sharing the manifest.
+     * a lock older than a minute is considered left by a killed process.
+     */
+    class ManifestLock {
+        std::string m_path;
+    public:
+        explicit ManifestLock(const std::string &path): m_path(path)
+        {
+            for (;;) {
+                FILE *fp = aa_fopen(m_path.c_str(), "wbx");
+                if (fp) {
+                    std::fclose(fp);
+                    return;
+                }
+                if (errno != EEXIST)
+                    throw_file_error(m_path, std::strerror(errno));
+                aa_stat_t st;
+                if (aa_stat(m_path.c_str(), &st) == 0
+                    && st.mtime + 60 < static_cast<int64_t>(std::time(0)))
+                    aa_unlink(m_path.c_str());
+                else
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        ~ManifestLock() { aa_unlink(m_path.c_str()); }
+    };
+}
+
+PlanManifest::PlanManifest(const std::string &filename)
+    : m_filename(filename)
+{
+    load_manifest(filename, &m_previous);
+}
+
+bool PlanManifest::is_unchanged(const std::string &output,
+                                const std::string &plan)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto e = m_previous.find(output);
+    aa_stat_t st;
+    return e != m_previous.end() && e->second == plan
+        && aa_stat(output.c_str(), &st) == 0;
+}
+
+void PlanManifest::update(const std::string &output, const std::string &plan)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_current[output] = plan;
+}
+
+/*
+ * entries on disk are reloaded and merged, since the manifest can be
+ * shared with other invocations, which have saved it since we loaded.
+ */
+void PlanManifest::save(bool complete)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ManifestLock file_lock(m_filename + ".lock");
+    std::map<std::string, std::string> entries;
+    load_manifest(m_filename, &entries);
+    for (auto e = m_current.begin(); e != m_current.end(); ++e)
+        entries[e->first] = e->second;
+    if (complete) {
+        /* outputs which no longer exist */
+        aa_stat_t st;
+        for (auto e = entries.begin(); e != entries.end(); )
+            if (aa_stat(e->first.c_str(), &st) != 0)
+                e = entries.erase(e);
+            else
+                ++e;
+    }
+
+    std::string tmpname = m_filename + ".tmp";
+    FILE *fp = aa_fopen(tmpname.c_str(), "wb");
+    if (!fp)
+        throw_file_error(tmpname, std::strerror(errno));
+    for (auto e = entries.begin(); e != entries.end(); ++e)
+        std::fprintf(fp, "%s\n", e->second.c_str());
+    if (std::fclose(fp) != 0 || aa_rename(tmpname.c_str(), m_filename.c_str()))
+        throw_file_error(m_filename, std::strerror(errno));
+}
@@ -0,0 +1,44 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef PlanManifest_H
+#define PlanManifest_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+/*
+ * Manifest of plans (see --plan) of the outputs written by previous run.
+ * Each line of the manifest is a plan in JSON, and outputs are identified
+ * by "output" member of it.
+ * An output is rewritten only when its plan has changed since the
+ * previous run.
+ */
+class PlanManifest {
+    std::string m_filename;
+    std::map<std::string, std::string> m_previous;
+    std::map<std::string, std::string> m_current;
+    std::mutex m_mutex;
+public:
+    /* previous manifest is loaded if exists */
+    explicit PlanManifest(const std::string &filename);
+    /*
+     * true when the output has identical plan in previous manifest,
+     * and the output file still exists.
+     */
+    bool is_unchanged(const std::string &output, const std::string &plan);
+    void update(const std::string &output, const std::string &plan);
+    /*
+     * write the manifest, merged with entries saved by other invocations
+     * sharing it.
+     * when complete, entries of outputs which no longer exist are dropped.
+     */
+    void save(bool complete);
+private:
+    PlanManifest(const PlanManifest &);
+    PlanManifest &operator=(const PlanManifest &);
+};
+
+#endif
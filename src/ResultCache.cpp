@@ -0,0 +1,258 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "ResultCache.h"
+#include "compat.h"
+#include "die.h"
+#include "json.h"
+
+namespace {
+
+std::string hash_key(const std::string &key)
+{
+    /* collisions are detected by the key text in the entry */
+    return fnv1a_hex(key);
+}
+
+bool read_file(const std::string &filename, std::string *data)
+{
+    FILE *fp = aa_fopen(filename.c_str(), "rb");
+    if (!fp)
+        return false;
+    std::shared_ptr<FILE> __fp__(fp, std::fclose);
+    char buf[8192];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof buf, fp)) > 0)
+        data->append(buf, n);
+    return !std::ferror(fp);
+}
+
+bool copy_file(const std::string &from, const std::string &to)
+{
+    FILE *ifp = aa_fopen(from.c_str(), "rb");
+    if (!ifp)
+        return false;
+    std::shared_ptr<FILE> __ifp__(ifp, std::fclose);
+    FILE *ofp = aa_fopen(to.c_str(), "wb");
+    if (!ofp)
+        return false;
+    std::vector<char> buf(1 << 20);
+    size_t n;
+    bool ok = true;
+    while (ok && (n = std::fread(&buf[0], 1, buf.size(), ifp)) > 0)
+        ok = std::fwrite(&buf[0], 1, n, ofp) == n;
+    ok = std::fclose(ofp) == 0 && ok && !std::ferror(ifp);
+    if (!ok)
+        aa_unlink(to.c_str());
+    return ok;
+}
+
+/* hard link, reflink or copy */
+bool place_file(const std::string &from, const std::string &to)
+{
+    return aa_link(from.c_str(), to.c_str()) == 0
+        || aa_clone_file(from.c_str(), to.c_str()) == 0
+        || copy_file(from, to);
+}
+
+int collect_key_file(void *opaque, const char *name)
+{
+    size_t len = std::strlen(name);
+    if (len == 20 && !std::strcmp(name + 16, ".key"))
+        static_cast<std::vector<std::string> *>(opaque)
+            ->push_back(std::string(name, 16));
+    return 0;
+}
+
+} // end of empty namespace
+
+ResultCache::ResultCache(const std::string &dir, uint64_t quota)
+    : m_dir(dir), m_quota(quota), m_counter(0), m_size(0)
+{
+    if (m_dir.size() && !std::strchr("/\\", m_dir[m_dir.size() - 1]))
+        m_dir.push_back('/');
+
+    std::random_device rd;
+    std::stringstream ss;
+    ss << std::hex << rd() << rd();
+    m_token = ss.str();
+
+    std::vector<std::string> hashes;
+    if (aa_readdir(m_dir.c_str(), collect_key_file, &hashes) < 0)
+        throw_file_error(dir, std::strerror(errno));
+    std::vector<std::pair<int64_t, Entry> > entries;
+    for (auto h = hashes.begin(); h != hashes.end(); ++h) {
+        aa_stat_t kst, st;
+        if (aa_stat(path(*h, ".key").c_str(), &kst) < 0)
+            continue;
+        if (aa_stat(path(*h, ".m4a").c_str(), &st) < 0) {
+            aa_unlink(path(*h, ".key").c_str());
+            continue;
+        }
+        Entry e = { *h, st.size };
+        entries.push_back(std::make_pair(kst.mtime, e));
+    }
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const std::pair<int64_t, Entry> &a,
+                        const std::pair<int64_t, Entry> &b) {
+                         return a.first > b.first;
+                     });
+    for (auto e = entries.begin(); e != entries.end(); ++e) {
+        m_entries.push_back(e->second);
+        m_index[e->second.hash] = --m_entries.end();
+        m_size += e->second.size;
+    }
+    evict();
+}
+
+/*
+ * entries stored by other processes are looked up as well, so the
+ * directory is always consulted.
+ */
+bool ResultCache::fetch(const std::string &key, const std::string &output)
+{
+    std::string hash = hash_key(key);
+    if (!validate(hash, key))
+        return false;
+    std::string tmpname = temporary_name(output);
+    if (!place_file(path(hash, ".m4a"), tmpname))
+        return false;
+    if (aa_rename(tmpname.c_str(), output.c_str())) {
+        int err = errno;
+        aa_unlink(tmpname.c_str());
+        throw_file_error(output, std::strerror(err));
+    }
+    aa_stat_t st;
+    if (aa_stat(path(hash, ".m4a").c_str(), &st) == 0)
+        touch(hash, key, st);
+    return true;
+}
+
+/* failure to store is not an error of the output, and is ignored */
+void ResultCache::store(const std::string &key, const std::string &output)
+{
+    std::string hash = hash_key(key);
+    std::string entry = path(hash, ".m4a");
+    aa_stat_t st;
+    if (aa_stat(output.c_str(), &st) < 0 || st.size > m_quota)
+        return;
+    std::string tmpname = temporary_name(entry);
+    if (!place_file(output, tmpname))
+        return;
+    if (aa_rename(tmpname.c_str(), entry.c_str())) {
+        aa_unlink(tmpname.c_str());
+        return;
+    }
+    if (aa_stat(entry.c_str(), &st) == 0)
+        touch(hash, key, st);
+}
+
+std::string ResultCache::path(const std::string &hash, const char *ext) const
+{
+    return m_dir + hash + ext;
+}
+
+std::string ResultCache::temporary_name(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::stringstream ss;
+    ss << name << "." << m_token << "-" << m_counter++ << ".tmp";
+    return ss.str();
+}
+
+/*
+ * true when <hash>.key has the same key text, and <hash>.m4a has not
+ * been modified since stored.
+ */
+bool ResultCache::validate(const std::string &hash, const std::string &key)
+{
+    std::string data;
+    if (!read_file(path(hash, ".key"), &data))
+        return false;
+    aa_stat_t st;
+    try {
+        JSONValue record = JSONValue::parse(data);
+        const JSONValue *k = record.get("key");
+        const JSONValue *size = record.get("size");
+        const JSONValue *mtime = record.get("mtime");
+        if (!k || !size || !mtime || k->type() != JSONValue::STRING)
+            throw std::runtime_error("malformed cache entry");
+        if (k->as_string() != key)
+            return false;  /* collision */
+        if (aa_stat(path(hash, ".m4a").c_str(), &st) == 0
+            && st.size == uint64_t(size->as_number())
+            && st.mtime == int64_t(mtime->as_number()))
+            return true;
+    } catch (const std::runtime_error &) {}
+    drop(hash);
+    return false;
+}
+
+/* write <hash>.key, and make the entry the most recently used */
+void ResultCache::touch(const std::string &hash, const std::string &key,
+                        const aa_stat_t &st)
+{
+    std::string keyfile = path(hash, ".key");
+    std::string tmpname = temporary_name(keyfile);
+    FILE *fp = aa_fopen(tmpname.c_str(), "wb");
+    if (!fp)
+        return;
+    std::fprintf(fp, "{\"key\":%s,\"size\":%s,\"mtime\":%s}\n",
+                 json_quote(key).c_str(), json_number(st.size).c_str(),
+                 json_number(st.mtime).c_str());
+    if (std::fclose(fp) != 0 || aa_rename(tmpname.c_str(), keyfile.c_str())) {
+        aa_unlink(tmpname.c_str());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_index.find(hash);
+    if (i != m_index.end()) {
+        m_size -= i->second->size;
+        m_entries.erase(i->second);
+    }
+    Entry e = { hash, st.size };
+    m_entries.push_front(e);
+    m_index[hash] = m_entries.begin();
+    m_size += st.size;
+    evict();
+}
+
+void ResultCache::drop(const std::string &hash)
+{
+    aa_unlink(path(hash, ".key").c_str());
+    aa_unlink(path(hash, ".m4a").c_str());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_index.find(hash);
+    if (i != m_index.end()) {
+        m_size -= i->second->size;
+        m_entries.erase(i->second);
+        m_index.erase(i);
+    }
+}
+
+/* called with the lock held */
+void ResultCache::evict()
+{
+    while (m_size > m_quota && !m_entries.empty()) {
+        const Entry &e = m_entries.back();
+        aa_unlink(path(e.hash, ".key").c_str());
+        aa_unlink(path(e.hash, ".m4a").c_str());
+        m_size -= e.size;
+        m_index.erase(e.hash);
+        m_entries.pop_back();
+    }
+}
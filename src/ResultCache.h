@@ -0,0 +1,65 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef ResultCache_H
+#define ResultCache_H
+
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include "compat.h"
+
+/*
+ * Content-addressed cache of outputs in a local directory, so that a
+ * repeated request is served without muxing.
+ *
+ * An output is identified by a key text (describing inputs, cut and
+ * tags), and is stored as <hash>.m4a with <hash>.key holding the key
+ * text, size and mtime of the entry. An entry whose key doesn't match,
+ * or which has been modified (through a hard link) is dropped.
+ *
+ * Entries are evicted in LRU order to keep the total size under the
+ * quota. mtime of <hash>.key is the last use of the entry, so that the
+ * order survives restarts. The directory can be shared by processes.
+ */
+class ResultCache {
+    struct Entry {
+        std::string hash;
+        uint64_t size;
+    };
+    std::string m_dir;
+    uint64_t m_quota;
+    std::string m_token;  /* for temporary names */
+    unsigned m_counter;
+    std::list<Entry> m_entries;  /* most recently used first */
+    std::map<std::string, std::list<Entry>::iterator> m_index;
+    uint64_t m_size;
+    std::mutex m_mutex;
+public:
+    /* quota in bytes. existing entries in the directory are loaded */
+    ResultCache(const std::string &dir, uint64_t quota);
+    /*
+     * place the entry of the key into output (by hard link, reflink or
+     * copy, in this order of preference). false on miss.
+     */
+    bool fetch(const std::string &key, const std::string &output);
+    /* store the finished output as the entry of the key */
+    void store(const std::string &key, const std::string &output);
+private:
+    std::string path(const std::string &hash, const char *ext) const;
+    std::string temporary_name(const std::string &name);
+    bool validate(const std::string &hash, const std::string &key);
+    void touch(const std::string &hash, const std::string &key,
+               const aa_stat_t &st);
+    void drop(const std::string &hash);
+    void evict();
+
+    ResultCache(const ResultCache &);
+    ResultCache &operator=(const ResultCache &);
+};
+
+#endif
@@ -0,0 +1,96 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cctype>
+#include <map>
+#include <memory>
+#include "StringConverter.h"
+#include "StringConverterUTF8.h"
+#if HAVE_ICONV
+# include "StringConverterIConv.h"
+#elif defined(_WIN32)
+# include "StringConverterWin32.h"
+#endif
+
+namespace {
+
+/* lower case, without '-' and '_' */
+std::string cleanse_charset_name(const std::string &s)
+{
+    std::string res;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = s[i];
+        if (c != '_' && c != '-')
+            res.push_back(std::tolower(c));
+    }
+    return res;
+}
+
+struct Converter {
+    std::shared_ptr<IStringConverter> impl;
+    bool ascii_compatible;  /* ASCII text is the same in the encoding */
+};
+
+/*
+ * ASCII text is the same in the encoding, when ASCII characters (except
+ * for NUL) are converted into themselves.
+ * the check is done by the converter rather than by the name of the
+ * encoding, since names have many aliases. wide encodings fail as a
+ * matter of course, and 7 bit stateful ones fail on their shift
+ * sequences: UTF-7, ISO-2022-JP, ISO-2022-KR (and CN) and HZ in order.
+ */
+bool is_ascii_compatible(IStringConverter *converter)
+{
+    std::string ascii;
+    for (int c = 1; c < 0x80; ++c)
+        ascii.push_back(c);
+    ascii += "+AGE-\x1b$B!!\x1b(B\x1b$)C\x0e!!\x0f~{!!~}";
+    std::pair<bool, std::string> res = converter->convert(ascii, true);
+    return res.first && res.second == ascii;
+}
+
+Converter &converter_for(const std::string &encoding)
+{
+    /* opening iconv is costly, and converters are not thread safe */
+    static thread_local std::map<std::string, Converter> cache;
+    Converter &converter = cache[encoding];
+    if (!converter.impl) {
+#if HAVE_ICONV
+        converter.impl =
+            std::make_shared<StringConverterIConv>("UTF-8", encoding.c_str());
+#elif defined(_WIN32)
+        converter.impl =
+            std::make_shared<StringConverterWin32>("UTF-8", encoding.c_str());
+#else
+        converter.impl = std::make_shared<StringConverterUTF8>();
+#endif
+        converter.ascii_compatible = is_ascii_compatible(converter.impl.get());
+    }
+    return converter;
+}
+
+} // end of empty namespace
+
+bool convert_to_utf8(const std::string &encoding, std::string *text,
+                     size_t *error_offset)
+{
+    std::string name = cleanse_charset_name(encoding);
+    if (error_offset)
+        *error_offset = std::string::npos;
+    if (name == "utf8") {
+        StringConverterUTF8 validator;
+        return validator.validate(text->data(), text->size(), true,
+                                  error_offset);
+    }
+    Converter &converter = converter_for(encoding);
+    if (converter.ascii_compatible
+        && ascii_length(text->data(), text->size()) == text->size())
+        return true;
+    std::pair<bool, std::string> res = converter.impl->convert(*text, true);
+    text->swap(res.second);
+    return res.first;
+}
@@ -1,6 +1,7 @@
 #ifndef STRING_CONVERTER
 #define STRING_CONVERTER
 
+#include <cstddef>
 #include <string>
 #include <utility>
 
@@ -9,4 +10,15 @@ struct IStringConverter {
     virtual std::pair<bool, std::string> convert(const std::string &s, bool flush)=0;
 };
 
+/*
+ * convert whole of text from the encoding into UTF-8, in place.
+ * ASCII text (in ASCII compatible encodings) is passed through, and
+ * UTF-8 is only validated, without copy.
+ * converters are cached for each thread.
+ * false when text is not valid in the encoding. for UTF-8, offset of
+ * the invalid sequence is stored into error_offset (npos otherwise).
+ */
+bool convert_to_utf8(const std::string &encoding, std::string *text,
+                     size_t *error_offset=0);
+
 #endif
@@ -17,23 +17,37 @@ StringConverterIConv::StringConverterIConv(const char *tocharset,
 std::pair<bool, std::string>
 StringConverterIConv::convert(const std::string &s, bool flush)
 {
-    m_remainder += s;
-    std::vector<char> dest(2);
-    size_t iblen = m_remainder.size(),
-           oblen = dest.size() - 1;
-    char  *ip    = const_cast<char *>(m_remainder.data());
-    char  *op    = dest.data();
+    /* input is copied only when a partial sequence is left by last call */
+    const std::string *input = &s;
+    if (m_remainder.size()) {
+        m_remainder += s;
+        input = &m_remainder;
+    }
+    iconv_t cd = static_cast<iconv_t>(m_handle.get());
+    /*
+     * sized for the worst case of single byte charsets into UTF-8,
+     * so that iconv() usually completes at once.
+     */
+    std::string dest(input->size() * 3 + 16, '\0');
+    size_t iblen = input->size(),
+           oblen = dest.size();
+    char  *ip    = const_cast<char *>(input->data());
+    char  *op    = &dest[0];
     bool   res   = true;
 
-    while (int(iconv(static_cast<iconv_t>(m_handle.get()),
-                 &ip, &iblen, &op, &oblen)) == -1) {
-        if (errno == E2BIG) {
-            ptrdiff_t off = op - dest.data();
-            dest.resize(dest.size() * 2);
-            op    = dest.data() + off;
-            oblen = dest.size() - off - 1;
-        } else if (flush || errno == EILSEQ) {
+    auto grow = [&]() {
+        ptrdiff_t off = op - dest.data();
+        dest.resize(dest.size() * 2);
+        op    = &dest[off];
+        oblen = dest.size() - off;
+    };
+    while (int(iconv(cd, &ip, &iblen, &op, &oblen)) == -1) {
+        if (errno == E2BIG)
+            grow();
+        else if (flush || errno == EILSEQ) {
             res = false;
+            if (!oblen)
+                grow();
             --iblen;
             --oblen;
             ip++;
@@ -41,10 +55,13 @@ StringConverterIConv::convert(const std::string &s, bool flush)
         } else
             break;
     }
-    ptrdiff_t off = ip - m_remainder.data();
-    if (off == int(m_remainder.size()))
-        m_remainder.clear();
-    else
-        m_remainder = m_remainder.substr(off);
-    return std::make_pair(res, std::string(dest.data(), op - dest.data()));
+    if (flush) {
+        /* back to the initial shift state, for the next text */
+        while (int(iconv(cd, 0, 0, &op, &oblen)) == -1 && errno == E2BIG)
+            grow();
+    }
+    dest.resize(op - dest.data());
+    std::string remainder(ip, iblen);
+    m_remainder.swap(remainder);
+    return std::make_pair(res, std::move(dest));
 }
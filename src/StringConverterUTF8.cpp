@@ -1,43 +1,345 @@
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define UTF8_HAVE_LOOKUP 1
+#endif
 #include "StringConverterUTF8.h"
 
 namespace {
-    bool is_lead_byte(unsigned char c)
+    /*
+     * length of the sequence at p, 0 when invalid, -1 when truncated
+     * (valid so far, but avail is not enough).
+     * see Table 3-7 of the Unicode Standard for the ranges.
+     */
+    int sequence_length(const uint8_t *p, size_t avail)
     {
-        return c < 0x80 || (c >= 0xc0 && c <= 0xfd);
+        uint8_t c = p[0], lo = 0x80, hi = 0xbf;
+        int len;
+        if (c < 0x80) return 1;
+        else if (c < 0xc2) return 0;
+        else if (c < 0xe0) len = 2;
+        else if (c < 0xf0) {
+            len = 3;
+            if (c == 0xe0) lo = 0xa0;       /* overlong */
+            else if (c == 0xed) hi = 0x9f;  /* surrogates */
+        } else if (c < 0xf5) {
+            len = 4;
+            if (c == 0xf0) lo = 0x90;       /* overlong */
+            else if (c == 0xf4) hi = 0x8f;  /* above U+10FFFF */
+        } else
+            return 0;
+        for (int i = 1; i < len; ++i, lo = 0x80, hi = 0xbf) {
+            if (size_t(i) == avail) return -1;
+            if (p[i] < lo || p[i] > hi) return 0;
+        }
+        return len;
     }
-    int num_trailing_bytes(unsigned char c)
+
+    /*
+     * vectorized part of validation: returns number of bytes from p
+     * known to be valid, which ends at a sequence boundary.
+     * the rest is examined by sequence_length().
+     */
+    typedef size_t (*skip_valid_t)(const uint8_t *p, size_t n);
+
+    size_t skip_ascii(const uint8_t *p, size_t n)
+    {
+        return ascii_length(reinterpret_cast<const char *>(p), n);
+    }
+
+#if UTF8_HAVE_LOOKUP
+    /*
+     * Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction
+     * Per Byte". each byte is classified by three 16 entry lookups of
+     * nibbles of itself and the previous byte, and the error bits are
+     * ANDed. requirements of 3rd and 4th bytes are checked separately.
+     */
+    enum {
+        TOO_SHORT  = 1 << 0,  /* lead not followed by continuation */
+        TOO_LONG   = 1 << 1,  /* ASCII followed by continuation */
+        OVERLONG_3 = 1 << 2,
+        TOO_LARGE  = 1 << 3,
+        SURROGATE  = 1 << 4,
+        OVERLONG_2 = 1 << 5,
+        TOO_LARGE_1000 = 1 << 6,
+        OVERLONG_4 = 1 << 6,
+        TWO_CONTS  = 1 << 7,  /* continuation after continuation */
+        CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS
+    };
+    const uint8_t byte_1_high[16] = {
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+    };
+    const uint8_t byte_1_low[16] = {
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000
+    };
+    const uint8_t byte_2_high[16] = {
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000
+            | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+    };
+
+    /*
+     * blocks before i are valid but the sequence at the end of them,
+     * which is examined again from its lead.
+     */
+    size_t sequence_start(const uint8_t *p, size_t i)
+    {
+        size_t lead = i - 1;
+        while (lead > 0 && i - lead < 4 && (p[lead] & 0xc0) == 0x80)
+            --lead;
+        return lead;
+    }
+
+    /*
+     * SSSE3 version works on 16 byte blocks, otherwise the same as AVX2.
+     */
+    __attribute__((target("ssse3")))
+    inline __m128i lookup16(const uint8_t *table, __m128i index)
+    {
+        return _mm_shuffle_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(table)),
+                index);
+    }
+
+    /* input shifted by n bytes, filled with the tail of prev */
+    template <int N>
+    __attribute__((target("ssse3")))
+    inline __m128i prev_bytes(__m128i input, __m128i prev)
     {
-        if (c < 0x80) return 0;
-        else if (c < 0xe0) return 1;
-        else if (c < 0xf0) return 2;
-        else if (c < 0xf8) return 3;
-        else if (c < 0xfc) return 4;
-        else return 5;
+        return _mm_alignr_epi8(input, prev, 16 - N);
     }
+
+    __attribute__((target("ssse3")))
+    inline bool is_zero(__m128i v)
+    {
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))
+            == 0xffff;
+    }
+
+    __attribute__((target("ssse3")))
+    size_t skip_valid_ssse3(const uint8_t *p, size_t n)
+    {
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        const __m128i max_value = _mm_setr_epi8(
+                -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, char(0xef), char(0xdf), char(0xbf));
+        __m128i prev_input = _mm_setzero_si128();
+        __m128i prev_incomplete = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i input =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+            __m128i error;
+            if (!_mm_movemask_epi8(input))
+                error = prev_incomplete;
+            else {
+                __m128i prev1 = prev_bytes<1>(input, prev_input);
+                __m128i sc = _mm_and_si128(
+                    _mm_and_si128(
+                        lookup16(byte_1_high, _mm_and_si128(
+                                _mm_srli_epi16(prev1, 4), nibble)),
+                        lookup16(byte_1_low, _mm_and_si128(prev1, nibble))),
+                    lookup16(byte_2_high, _mm_and_si128(
+                            _mm_srli_epi16(input, 4), nibble)));
+                __m128i prev2 = prev_bytes<2>(input, prev_input);
+                __m128i prev3 = prev_bytes<3>(input, prev_input);
+                __m128i must23 = _mm_or_si128(
+                        _mm_subs_epu8(prev2, _mm_set1_epi8(0x60)),
+                        _mm_subs_epu8(prev3, _mm_set1_epi8(0x70)));
+                must23 = _mm_and_si128(must23, _mm_set1_epi8(char(0x80)));
+                error = _mm_xor_si128(must23, sc);
+                prev_incomplete = _mm_subs_epu8(input, max_value);
+            }
+            if (!is_zero(error))
+                break;
+            prev_input = input;
+        }
+        if (i == 0 || (i + 16 > n && is_zero(prev_incomplete)))
+            return i;
+        return sequence_start(p, i);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i lookup16(const uint8_t *table, __m256i index)
+    {
+        __m256i t = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(table)));
+        return _mm256_shuffle_epi8(t, index);
+    }
+
+    template <int N>
+    __attribute__((target("avx2")))
+    inline __m256i prev_bytes(__m256i input, __m256i prev)
+    {
+        return _mm256_alignr_epi8(input,
+                                  _mm256_permute2x128_si256(prev, input, 0x21),
+                                  16 - N);
+    }
+
+    __attribute__((target("avx2")))
+    size_t skip_valid_avx2(const uint8_t *p, size_t n)
+    {
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        /* 0xff except for the last 3 bytes, where a lead can't appear */
+        const __m256i max_value = _mm256_setr_epi8(
+                -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, char(0xef), char(0xdf), char(0xbf));
+        __m256i prev_input = _mm256_setzero_si256();
+        __m256i prev_incomplete = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i input =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+            __m256i error;
+            if (!_mm256_movemask_epi8(input))
+                error = prev_incomplete;
+            else {
+                __m256i prev1 = prev_bytes<1>(input, prev_input);
+                __m256i sc = _mm256_and_si256(
+                    _mm256_and_si256(
+                        lookup16(byte_1_high, _mm256_and_si256(
+                                _mm256_srli_epi16(prev1, 4), nibble)),
+                        lookup16(byte_1_low, _mm256_and_si256(prev1, nibble))),
+                    lookup16(byte_2_high, _mm256_and_si256(
+                            _mm256_srli_epi16(input, 4), nibble)));
+                /* 3rd byte of 111_____, or 4th byte of 1111____ */
+                __m256i prev2 = prev_bytes<2>(input, prev_input);
+                __m256i prev3 = prev_bytes<3>(input, prev_input);
+                __m256i must23 = _mm256_or_si256(
+                        _mm256_subs_epu8(prev2, _mm256_set1_epi8(0x60)),
+                        _mm256_subs_epu8(prev3, _mm256_set1_epi8(0x70)));
+                must23 = _mm256_and_si256(must23, _mm256_set1_epi8(char(0x80)));
+                error = _mm256_xor_si256(must23, sc);
+                prev_incomplete = _mm256_subs_epu8(input, max_value);
+            }
+            if (!_mm256_testz_si256(error, error))
+                break;
+            prev_input = input;
+        }
+        if (i == 0 || (i + 32 > n && _mm256_testz_si256(prev_incomplete,
+                                                        prev_incomplete)))
+            return i;
+        return sequence_start(p, i);
+    }
+#endif
+
+    skip_valid_t select_skip_valid()
+    {
+#if UTF8_HAVE_LOOKUP
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return skip_valid_avx2;
+        if (__builtin_cpu_supports("ssse3"))
+            return skip_valid_ssse3;
+#endif
+        return skip_ascii;
+    }
+}
+
+size_t ascii_length(const char *s, size_t n)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(s);
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    for (; i + 64 <= n; i += 64) {
+        const __m128i *v = reinterpret_cast<const __m128i *>(p + i);
+        if (_mm_movemask_epi8(_mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+                _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)))))
+            break;
+    }
+    for (; i + 16 <= n; i += 16)
+        if (_mm_movemask_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i))))
+            break;
+#endif
+    /* 8 bytes at a time */
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, p + i, 8);
+        if (v & 0x8080808080808080ULL)
+            break;
+    }
+    for (; i < n && p[i] < 0x80; ++i)
+        ;
+    return i;
+}
+
+size_t utf8_valid_length(const char *s, size_t n)
+{
+    static const skip_valid_t skip_valid = select_skip_valid();
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(s);
+    size_t i = 0;
+    while ((i += skip_valid(p + i, n - i)) < n) {
+        int len = sequence_length(p + i, n - i);
+        if (len <= 0)
+            return i;
+        i += len;
+    }
+    return n;
 }
 
 std::pair<bool, std::string>
 StringConverterUTF8::convert(const std::string &s, bool flush)
 {
-    const char *end = s.data() + s.size();
-    const char *p = s.data();
-    std::string dest;
-    bool good = true;
-    unsigned char c;
-
-    for (; m_trailing > 0 && p < end; --m_trailing)
-        if (((c = *p++) >> 6) != 2)
-            good = false;
-
-    while (good && p < end) {
-        if (!is_lead_byte(c = *p++))
-            good = false;
-        m_trailing = num_trailing_bytes(c);
-        for (; m_trailing > 0 && p < end; --m_trailing)
-            if (((c = *p++) >> 6) != 2)
-                good = false;
-    }
-    if (m_trailing && flush)
-        good = false;
-    return std::make_pair(good, s);
+    return std::make_pair(validate(s.data(), s.size(), flush), s);
+}
+
+bool StringConverterUTF8::validate(const char *s, size_t n, bool flush,
+                                   size_t *error_offset)
+{
+    /* only when a sequence is split by the last call */
+    std::string joined;
+    size_t pending = m_pending.size();
+    if (pending) {
+        joined = m_pending + std::string(s, n);
+        s = joined.data();
+        n = joined.size();
+        m_pending.clear();
+    }
+    size_t valid = utf8_valid_length(s, n);
+    if (valid < n && !flush
+        && sequence_length(reinterpret_cast<const uint8_t *>(s + valid),
+                           n - valid) < 0)
+    {
+        m_pending.assign(s + valid, n - valid);
+        valid = n;
+    }
+    if (valid == n)
+        return true;
+    if (error_offset)
+        *error_offset = valid > pending ? valid - pending : 0;
+    return false;
 }
@@ -5,11 +5,27 @@
 #include <utility>
 #include "StringConverter.h"
 
+/* length of the ASCII prefix of s (bytes below 0x80) */
+size_t ascii_length(const char *s, size_t n);
+
+/*
+ * length of the valid UTF-8 prefix of s, that is, offset of the first
+ * invalid (or truncated) sequence. n when all of s is valid.
+ * overlongs, surrogates and code points above U+10FFFF are invalid.
+ */
+size_t utf8_valid_length(const char *s, size_t n);
+
 class StringConverterUTF8: public IStringConverter {
-    int m_trailing;
+    std::string m_pending;  /* truncated sequence at the end of last input */
 public:
-    StringConverterUTF8() : m_trailing(0) {}
     std::pair<bool, std::string> convert(const std::string &s, bool flush=true);
+    /*
+     * same as convert(), without copying s.
+     * on failure, offset of the invalid sequence in s is stored into
+     * error_offset.
+     */
+    bool validate(const char *s, size_t n, bool flush=true,
+                  size_t *error_offset=0);
 };
 
 #endif
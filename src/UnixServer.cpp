@@ -0,0 +1,181 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "UnixServer.h"
+#include "die.h"
+
+UnixServer::UnixServer(const std::string &path, const handler_t &handler)
+    : m_path(path), m_handler(handler), m_fd(-1), m_dev(0), m_ino(0),
+      m_stopped(false)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof addr);
+    if (path.size() >= sizeof addr.sun_path)
+        throw_file_error(path, "socket path too long");
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.c_str());
+
+    /*
+     * only a stale socket is replaced: not a file of other kind, nor the
+     * socket of a live server (which accepts connect())
+     */
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+            throw_file_error(path, std::strerror(EEXIST));
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr),
+                                       sizeof addr) == 0;
+        if (fd >= 0)
+            close(fd);
+        if (live)
+            throw_file_error(path, std::strerror(EADDRINUSE));
+        unlink(path.c_str());
+    }
+    if ((m_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        throw_file_error(path, std::strerror(errno));
+    if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0
+        || listen(m_fd, SOMAXCONN) < 0
+        || lstat(path.c_str(), &st) < 0)
+    {
+        int err = errno;
+        close(m_fd);
+        throw_file_error(path, std::strerror(err));
+    }
+    m_dev = st.st_dev;
+    m_ino = st.st_ino;
+    /* broken connection is reported by write() */
+    std::signal(SIGPIPE, SIG_IGN);
+}
+
+UnixServer::~UnixServer()
+{
+    drain();
+    close(m_fd);
+    /* unless replaced by someone else meanwhile */
+    struct stat st;
+    if (lstat(m_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)
+        && uint64_t(st.st_dev) == m_dev && uint64_t(st.st_ino) == m_ino)
+        unlink(m_path.c_str());
+}
+
+void UnixServer::run()
+{
+    try {
+        while (!m_stopped) {
+            int fd = accept(m_fd, 0, 0);
+            if (fd < 0) {
+                if (m_stopped)
+                    break;
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                throw_file_error(m_path, std::strerror(errno));
+            }
+            reap();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Connection conn = { std::thread(), fd, false };
+            m_connections.push_back(std::move(conn));
+            Connection *c = &m_connections.back();
+            c->thread = std::thread(&UnixServer::serve, this, c);
+        }
+    } catch (...) {
+        drain();
+        throw;
+    }
+    drain();
+}
+
+void UnixServer::stop()
+{
+    m_stopped = true;
+    /* wakes up accept() */
+    shutdown(m_fd, SHUT_RDWR);
+}
+
+void UnixServer::reap()
+{
+    std::list<Connection> finished;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto c = m_connections.begin(); c != m_connections.end();) {
+            auto next = c;
+            ++next;
+            if (c->done)
+                finished.splice(finished.end(), m_connections, c);
+            c = next;
+        }
+    }
+    for (auto c = finished.begin(); c != finished.end(); ++c)
+        c->thread.join();
+}
+
+void UnixServer::drain()
+{
+    std::list<Connection> connections;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        /* reading end only, so that responses in progress are sent */
+        for (auto c = m_connections.begin(); c != m_connections.end(); ++c)
+            if (c->fd >= 0)
+                shutdown(c->fd, SHUT_RD);
+        connections.swap(m_connections);
+    }
+    for (auto c = connections.begin(); c != connections.end(); ++c)
+        c->thread.join();
+}
+
+void UnixServer::serve(Connection *conn)
+{
+    int fd = conn->fd;
+    std::string buffer;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof chunk)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        buffer.append(chunk, n);
+        size_t pos;
+        while ((pos = buffer.find('\n')) != std::string::npos) {
+            std::string line = buffer.substr(0, pos);
+            buffer.erase(0, pos + 1);
+            if (line.size() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+            std::string response = m_handler(line) + "\n";
+            const char *p = response.data();
+            size_t left = response.size();
+            while (left > 0) {
+                ssize_t nw = write(fd, p, left);
+                if (nw < 0 && errno == EINTR)
+                    continue;
+                if (nw <= 0)
+                    goto done;
+                p += nw;
+                left -= nw;
+            }
+        }
+    }
+done:
+    std::lock_guard<std::mutex> lock(m_mutex);
+    close(fd);
+    conn->fd = -1;
+    conn->done = true;
+}
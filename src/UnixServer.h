@@ -0,0 +1,61 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef UnixServer_H
+#define UnixServer_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+ * line oriented server on Unix domain socket.
+ * each connection is served by its own thread, and handler is called for
+ * each line received. returned string is sent back as a line.
+ * handler is called concurrently, and is expected not to throw.
+ * connection threads are joined before run() returns (or throws).
+ */
+class UnixServer {
+public:
+    typedef std::function<std::string(const std::string &)> handler_t;
+private:
+    struct Connection {
+        std::thread thread;
+        int fd;      /* -1 once closed */
+        bool done;
+    };
+    std::string m_path;
+    handler_t m_handler;
+    int m_fd;
+    uint64_t m_dev, m_ino;  /* of the socket file */
+    std::atomic<bool> m_stopped;
+    std::list<Connection> m_connections;
+    std::mutex m_mutex;
+public:
+    /*
+     * stale socket file at path is replaced. fails when another kind of
+     * file exists there, or another server is listening on it.
+     */
+    UnixServer(const std::string &path, const handler_t &handler);
+    ~UnixServer();
+    /* accept connections until stop() is called or an error occurs */
+    void run();
+    /* make run() return. async-signal-safe */
+    void stop();
+private:
+    void serve(Connection *conn);
+    /* join threads of finished connections */
+    void reap();
+    /* close all connections (after requests in progress), and join */
+    void drain();
+
+    UnixServer(const UnixServer &);
+    UnixServer &operator=(const UnixServer &);
+};
+
+#endif
@@ -0,0 +1,68 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(unsigned nworkers)
+    : m_running(0), m_closing(false)
+{
+    if (!nworkers) nworkers = 1;
+    for (unsigned i = 0; i < nworkers; ++i)
+        m_workers.push_back(std::thread([this]() { run(); }));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closing = true;
+    }
+    m_job_cond.notify_all();
+    for (auto t = m_workers.begin(); t != m_workers.end(); ++t)
+        t->join();
+}
+
+void WorkerPool::submit(const std::function<void()> &job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(job);
+    }
+    m_job_cond.notify_one();
+}
+
+void WorkerPool::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle_cond.wait(lock, [this]() {
+        return m_jobs.empty() && m_running == 0;
+    });
+}
+
+void WorkerPool::run()
+{
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_job_cond.wait(lock, [this]() {
+                return m_closing || !m_jobs.empty();
+            });
+            if (m_jobs.empty())
+                return;
+            job = m_jobs.front();
+            m_jobs.pop_front();
+            ++m_running;
+        }
+        job();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_running;
+        }
+        m_idle_cond.notify_all();
+    }
+}
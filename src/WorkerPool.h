@@ -0,0 +1,47 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef WorkerPool_H
+#define WorkerPool_H
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * fixed size pool of worker threads.
+ * jobs are started in the order of submission.
+ * jobs are expected not to throw; exceptions have to be handled by
+ * jobs themselves.
+ */
+class WorkerPool {
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()> > m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_job_cond;
+    std::condition_variable m_idle_cond;
+    unsigned m_running;
+    bool m_closing;
+public:
+    explicit WorkerPool(unsigned nworkers);
+    ~WorkerPool();
+    void submit(const std::function<void()> &job);
+    /* wait until all of the submitted jobs are done */
+    void wait();
+    /* number of workers suitable for the host when not specified */
+    static unsigned default_concurrency()
+    {
+        unsigned n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+private:
+    void run();
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+};
+
+#endif
@@ -1,56 +1,49 @@
 #include <algorithm>
 #include "bitstream.h"
 
-uint32_t BitStream::peek(uint32_t nbits)
+void BitWriter::take(std::vector<uint8_t> *buffer)
 {
-    uint8_t *p = &m_buffer[m_cur];
-    uint32_t v = (*p++ << m_pos) & 0xff;
-    if (nbits <= 8 - m_pos)
-        return v >> (8 - nbits);
-    v >>= m_pos;
-    nbits = nbits - 8 + m_pos;
-    for (; nbits >= 8; nbits -= 8)
-        v = v << 8 | *p++;
-    if (nbits > 0)
-        v = v << nbits | (*p << nbits) >> 8;
-    return v;
-}
-
-uint32_t BitStream::get(uint32_t nbits)
-{
-    uint32_t value = peek(nbits);
-    advance(nbits);
-    return value;
+    size_t capacity = m_buffer.size();
+    byteAlign();
+    /* flush whole bytes left in the register */
+    for (; m_bits; m_bits -= 8) {
+        if (m_size == m_buffer.size())
+            m_buffer.resize(m_buffer.size() * 2);
+        m_buffer[m_size++] = uint8_t(m_acc >> (m_bits - 8));
+    }
+    m_buffer.resize(m_size);
+    buffer->swap(m_buffer);
+    m_buffer.assign(capacity, 0);
+    m_size = 0;
+    m_acc = 0;
 }
 
-void BitStream::put(uint32_t value, uint32_t nbits)
+void BitReader::refill_tail()
 {
-    uint32_t free_bits = 8 - m_pos;
-    while (nbits > 0) {
-        uint32_t width = std::min(free_bits, nbits);
-        uint32_t new_free_bits = free_bits - width;
-        uint32_t v = value >> (nbits - width);
-        uint32_t mask = 0xffu >> (8 - width);
-        mask <<= new_free_bits;
-        v = (v << new_free_bits) & mask;
-        while (m_buffer.size() <= m_cur)
-            m_buffer.push_back(0);
-        m_buffer[m_cur] = (m_buffer[m_cur] & ~mask) | v;
-        nbits -= width;
-        free_bits = new_free_bits;
-        if (free_bits == 0) {
-            ++m_cur;
-            free_bits = 8;
-        }
+    /* clear garbage of partially loaded byte */
+    m_cache = m_count ? m_cache & (~uint64_t(0) << (64 - m_count)) : 0;
+    while (m_count <= 56 && m_cur < m_end) {
+        m_cache |= uint64_t(*m_cur++) << (56 - m_count);
+        m_count += 8;
+    }
+    if (m_count <= 56) {
+        m_padding += 64 - m_count;
+        m_count = 64;
     }
-    m_pos = 8 - free_bits;
 }
 
-void BitStream::advance(size_t nbits)
+void BitReader::seek(size_t bitpos)
 {
-    if (nbits) {
-        m_pos += nbits;
-        m_cur += (m_pos >> 3);
-        m_pos &= 7;
+    size_t byte = std::min(bitpos >> 3, size());
+    m_cur = m_begin + byte;
+    m_cache = 0;
+    m_count = 0;
+    m_padding = 0;
+    if (bitpos > size() << 3)
+        m_padding = bitpos - (size() << 3);
+    else if (bitpos & 7) {
+        refill();
+        m_cache <<= bitpos & 7;
+        m_count -= bitpos & 7;
     }
 }
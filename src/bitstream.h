@@ -5,29 +5,131 @@
 #include <vector>
 #include <stdint.h>
 
-class BitStream {
+/*
+ * MSB first bit writer. bits are accumulated in a 64 bit register, and
+ * stored into the buffer by 32 bit words in big endian.
+ * the buffer is preallocated by the given capacity, and doubled when
+ * exhausted.
+ */
+class BitWriter {
     std::vector<uint8_t> m_buffer;
-    size_t m_cur, m_pos;
+    size_t   m_size;   /* number of bytes stored into m_buffer */
+    uint64_t m_acc;    /* pending bits, in the lower m_bits */
+    uint32_t m_bits;   /* less than 32 between calls */
 public:
-    BitStream(): m_cur(0), m_pos(0)
+    explicit BitWriter(size_t capacity = 64)
+        : m_buffer(capacity ? capacity : 1), m_size(0), m_acc(0), m_bits(0)
     {}
-    BitStream(const uint8_t *data, size_t size):
-        m_buffer(data, data + size), m_cur(0), m_pos(0)
+    size_t position() const { return (m_size << 3) + m_bits; }
+    /* nbits: up to 32. bits of value above nbits are ignored */
+    void put(uint32_t value, uint32_t nbits)
+    {
+        uint64_t mask = (uint64_t(1) << nbits) - 1;
+        m_acc = (m_acc << nbits) | (value & mask);
+        m_bits += nbits;
+        if (m_bits >= 32) {
+            m_bits -= 32;
+            store32(uint32_t(m_acc >> m_bits));
+        }
+    }
+    void byteAlign() { put(0, (8 - (m_bits & 7)) & 7); }
+    /*
+     * byte align, and move the written bytes into buffer.
+     * the writer is emptied, and can be reused.
+     */
+    void take(std::vector<uint8_t> *buffer);
+private:
+    void store32(uint32_t v)
+    {
+        if (m_buffer.size() - m_size < 4)
+            m_buffer.resize(m_buffer.size() * 2 + 4);
+        uint8_t *p = &m_buffer[m_size];
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+        m_size += 4;
+    }
+};
+
+/*
+ * MSB first bit reader over a buffer owned by caller.
+ * bits are taken from a 64 bit cache, which is refilled by 8 bytes load
+ * while enough bytes are left. reading past the end yields zeros, and
+ * sets overrun() (which stays set, since position only goes forward).
+ */
+class BitReader {
+    const uint8_t *m_begin, *m_cur, *m_end;  /* m_cur: next byte to load */
+    uint64_t m_cache;    /* MSB aligned */
+    uint32_t m_count;    /* number of valid bits in m_cache */
+    size_t   m_padding;  /* number of zero bits loaded past the end */
+public:
+    BitReader(const uint8_t *data, size_t size)
+        : m_begin(data), m_cur(data), m_end(data + size),
+          m_cache(0), m_count(0), m_padding(0)
     {}
-    size_t position() const { return (m_cur << 3) + m_pos; }
-    const uint8_t *data() const { return &m_buffer[0]; }
-    uint32_t peek(uint32_t nbits);
-    uint32_t get(uint32_t nbits);
-    void put(uint32_t value, uint32_t nbits);
-    void advance(size_t nbits);
-    void rewind() { m_cur = m_pos = 0; }
-    void byteAlign() { if (m_pos) put(0, 8 - m_pos); }
-    uint32_t copy(BitStream &src, uint32_t nbits)
-    {
-        uint32_t val = src.get(nbits);
-        put(val, nbits);
-        return val;
+    size_t size() const { return m_end - m_begin; }
+    size_t position() const
+    {
+        return ((m_cur - m_begin) << 3) + m_padding - m_count;
+    }
+    /* number of bits left, 0 on overrun */
+    size_t remaining() const
+    {
+        size_t pos = position(), size_bits = size() << 3;
+        return pos < size_bits ? size_bits - pos : 0;
+    }
+    bool overrun() const { return position() > (size() << 3); }
+    /* nbits: up to 32 */
+    uint32_t peek(uint32_t nbits)
+    {
+        if (m_count < nbits)
+            refill();
+        /* shifted twice, so that nbits == 0 works */
+        return uint32_t((m_cache >> 1) >> (63 - nbits));
+    }
+    uint32_t get(uint32_t nbits)
+    {
+        uint32_t value = peek(nbits);
+        m_cache <<= nbits;
+        m_count -= nbits;
+        return value;
+    }
+    void skip(size_t nbits)
+    {
+        if (nbits <= m_count) {
+            /* shifted twice, so that nbits == 64 works */
+            m_cache = (m_cache << (nbits >> 1)) << (nbits - (nbits >> 1));
+            m_count -= uint32_t(nbits);
+        } else
+            seek(position() + nbits);
+    }
+    void byteAlign() { skip((8 - (position() & 7)) & 7); }
+    void seek(size_t bitpos);
+private:
+    static uint64_t load64(const uint8_t *p)
+    {
+        /* compilers turn this into single load and bswap */
+        return uint64_t(p[0]) << 56 | uint64_t(p[1]) << 48
+             | uint64_t(p[2]) << 40 | uint64_t(p[3]) << 32
+             | uint64_t(p[4]) << 24 | uint64_t(p[5]) << 16
+             | uint64_t(p[6]) <<  8 | uint64_t(p[7]);
+    }
+    /* make at least 56 bits available in the cache */
+    void refill()
+    {
+        if (m_end - m_cur >= 8) {
+            /*
+             * load as many whole bytes as fit. bits of the partially
+             * loaded byte are loaded again by the next refill.
+             */
+            m_cache |= load64(m_cur) >> m_count;
+            m_cur += (63 - m_count) >> 3;
+            m_count |= 56;
+        } else
+            refill_tail();
     }
+    void refill_tail();
 };
 
 #endif
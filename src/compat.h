@@ -11,14 +11,50 @@ extern "C" {
 
 int64_t aa_timer(void);
 
+typedef struct aa_stat_t {
+    uint64_t size;
+    int64_t  mtime;     /* in seconds since epoch */
+    uint64_t ino;       /* 0 if not available */
+    int      is_dir;
+} aa_stat_t;
+
+int aa_stat(const char *name, aa_stat_t *st);
+/* replaces existing file */
+int aa_rename(const char *from, const char *to);
+int aa_fseek(FILE *fp, int64_t off, int whence);
+/* flush buffer of the stream, and the file down to the storage */
+int aa_fsync(FILE *fp);
+/* flush the file (or directory on POSIX) to the storage */
+int aa_sync_path(const char *name);
+/*
+ * flush whole of the filesystem containing the file.
+ * fails with ENOSYS when not supported on the platform.
+ */
+int aa_syncfs(const char *name);
+/* create hard link. fails when not on the same filesystem */
+int aa_link(const char *from, const char *to);
+/*
+ * create a copy sharing the data blocks (reflink).
+ * fails with ENOSYS when not supported on the platform.
+ */
+int aa_clone_file(const char *from, const char *to);
+/*
+ * call cb for each entry of the directory except for "." and "..".
+ * stops when cb returns non-zero.
+ */
+int aa_readdir(const char *dir, int (*cb)(void *opaque, const char *name),
+               void *opaque);
+
 #ifndef _WIN32
 # define aa_getmainargs(argc, argv) (void)(0)
 # define aa_fprintf fprintf
 # define aa_fopen   fopen
+# define aa_unlink  remove
 #else
   void   aa_getmainargs(int *argc, char ***argv);
   int    aa_fprintf(FILE *fp, const char *fmt, ...);
   FILE * aa_fopen(const char *name, const char *mode);
+  int    aa_unlink(const char *name);
 #endif
 
 #ifdef __cplusplus
@@ -5,10 +5,23 @@
 #if HAVE_CONFIG_H
 #  include "config.h"
 #endif
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #if HAVE_STDINT_H
 #  include <stdint.h>
 #endif
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#if HAVE_LINUX_FS_H
+#  include <linux/fs.h>
+#endif
 #include "compat.h"
 
 int64_t aa_timer(void)
@@ -17,3 +30,105 @@ int64_t aa_timer(void)
     gettimeofday(&tv, 0);
     return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
+
+int aa_stat(const char *name, aa_stat_t *st)
+{
+    struct stat sb;
+    if (stat(name, &sb) < 0)
+        return -1;
+    st->size  = sb.st_size;
+    st->mtime = sb.st_mtime;
+    st->ino   = sb.st_ino;
+    st->is_dir = S_ISDIR(sb.st_mode);
+    return 0;
+}
+
+int aa_rename(const char *from, const char *to)
+{
+    return rename(from, to);
+}
+
+int aa_fseek(FILE *fp, int64_t off, int whence)
+{
+    return fseeko(fp, off, whence);
+}
+
+int aa_fsync(FILE *fp)
+{
+    if (fflush(fp) != 0)
+        return -1;
+    return fsync(fileno(fp));
+}
+
+int aa_sync_path(const char *name)
+{
+    int fd, rc;
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return -1;
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+int aa_syncfs(const char *name)
+{
+#if HAVE_SYNCFS
+    int fd, rc;
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return -1;
+    rc = syncfs(fd);
+    close(fd);
+    return rc;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int aa_link(const char *from, const char *to)
+{
+    return link(from, to);
+}
+
+int aa_clone_file(const char *from, const char *to)
+{
+#ifdef FICLONE
+    int ifd, ofd, rc;
+    if ((ifd = open(from, O_RDONLY)) < 0)
+        return -1;
+    if ((ofd = open(to, O_WRONLY|O_CREAT|O_EXCL, 0666)) < 0) {
+        close(ifd);
+        return -1;
+    }
+    rc = ioctl(ofd, FICLONE, ifd);
+    close(ifd);
+    close(ofd);
+    if (rc < 0) {
+        int err = errno;
+        unlink(to);
+        errno = err;
+    }
+    return rc;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int aa_readdir(const char *dir, int (*cb)(void *opaque, const char *name),
+               void *opaque)
+{
+    DIR *dp;
+    struct dirent *de;
+
+    if ((dp = opendir(dir)) == 0)
+        return -1;
+    while ((de = readdir(dp)) != 0) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (cb(opaque, de->d_name))
+            break;
+    }
+    closedir(dp);
+    return 0;
+}
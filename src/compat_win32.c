@@ -13,7 +13,10 @@
 #include <sys/timeb.h>
 #include <io.h>
 #include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <share.h>
+#include <errno.h>
 #include "compat.h"
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -146,3 +149,145 @@ FILE *aa_fopen(const char *name, const char *mode)
     }
     return fp;
 }
+
+int aa_stat(const char *name, aa_stat_t *st)
+{
+    wchar_t *wname;
+    struct __stat64 sb;
+    int rc;
+
+    codepage_decode_wchar(CP_UTF8, name, &wname);
+    rc = _wstat64(wname, &sb);
+    free(wname);
+    if (rc < 0)
+        return -1;
+    st->size  = sb.st_size;
+    st->mtime = sb.st_mtime;
+    st->ino   = 0;
+    st->is_dir = (sb.st_mode & _S_IFDIR) != 0;
+    return 0;
+}
+
+int aa_rename(const char *from, const char *to)
+{
+    wchar_t *wfrom, *wto;
+    BOOL rc;
+
+    codepage_decode_wchar(CP_UTF8, from, &wfrom);
+    codepage_decode_wchar(CP_UTF8, to, &wto);
+    rc = MoveFileExW(wfrom, wto, MOVEFILE_REPLACE_EXISTING);
+    free(wfrom);
+    free(wto);
+    return rc ? 0 : -1;
+}
+
+int aa_unlink(const char *name)
+{
+    wchar_t *wname;
+    int rc;
+
+    codepage_decode_wchar(CP_UTF8, name, &wname);
+    rc = _wunlink(wname);
+    free(wname);
+    return rc;
+}
+
+int aa_fseek(FILE *fp, int64_t off, int whence)
+{
+    return _fseeki64(fp, off, whence);
+}
+
+int aa_fsync(FILE *fp)
+{
+    if (fflush(fp) != 0)
+        return -1;
+    return _commit(_fileno(fp));
+}
+
+int aa_sync_path(const char *name)
+{
+    wchar_t *wname;
+    HANDLE h;
+    BOOL rc;
+
+    codepage_decode_wchar(CP_UTF8, name, &wname);
+    h = CreateFileW(wname, GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE,
+                    0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    free(wname);
+    if (h == INVALID_HANDLE_VALUE) {
+        errno = EACCES;
+        return -1;
+    }
+    rc = FlushFileBuffers(h);
+    CloseHandle(h);
+    if (!rc) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+int aa_syncfs(const char *name)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int aa_link(const char *from, const char *to)
+{
+    wchar_t *wfrom, *wto;
+    BOOL rc;
+
+    codepage_decode_wchar(CP_UTF8, from, &wfrom);
+    codepage_decode_wchar(CP_UTF8, to, &wto);
+    rc = CreateHardLinkW(wto, wfrom, 0);
+    free(wfrom);
+    free(wto);
+    if (!rc) {
+        errno = EXDEV;
+        return -1;
+    }
+    return 0;
+}
+
+int aa_clone_file(const char *from, const char *to)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int aa_readdir(const char *dir, int (*cb)(void *opaque, const char *name),
+               void *opaque)
+{
+    wchar_t *wdir, *pattern;
+    WIN32_FIND_DATAW fd;
+    HANDLE h;
+    size_t len;
+
+    codepage_decode_wchar(CP_UTF8, dir, &wdir);
+    len = wcslen(wdir);
+    pattern = malloc((len + 3) * sizeof(wchar_t));
+    wcscpy(pattern, wdir);
+    if (len && wdir[len - 1] != L'/' && wdir[len - 1] != L'\\')
+        wcscat(pattern, L"\\");
+    wcscat(pattern, L"*");
+    h = FindFirstFileW(pattern, &fd);
+    free(wdir);
+    free(pattern);
+    if (h == INVALID_HANDLE_VALUE)
+        return -1;
+    do {
+        char *name;
+        int stop;
+        if (!wcscmp(fd.cFileName, L".") || !wcscmp(fd.cFileName, L".."))
+            continue;
+        if (codepage_encode_wchar(CP_UTF8, fd.cFileName, &name) < 0)
+            continue;
+        stop = cb(opaque, name);
+        free(name);
+        if (stop)
+            break;
+    } while (FindNextFileW(h, &fd));
+    FindClose(h);
+    return 0;
+}
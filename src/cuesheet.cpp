@@ -19,51 +19,71 @@ uint64_t frame2sample(double sampling_rate, uint32_t nframe)
     return static_cast<uint64_t>(nframe / 75.0 * sampling_rate + 0.5);
 }
 
-template <typename CharT>
-bool CueTokenizer<CharT>::nextline()
+static inline bool is_blank(char c)
+{
+    return c == ' ' || c == '\r' || c == '\t' || c == 0;
+}
+
+bool CueTokenizer::nextline()
 {
     m_fields.clear();
-    int_type c;
-    std::basic_string<CharT> field;
-    while (traits_type::not_eof(c = m_sb->sbumpc())) {
+    /* field being read, unquoted in place up to w */
+    char *field = m_cur, *w = m_cur;
+    bool eol = false;
+    while (m_cur < m_end) {
+        char c = *m_cur++;
         if (c == '"') {
             // eat until closing quote
-            while (traits_type::not_eof(c = m_sb->sbumpc())) {
+            while (m_cur < m_end) {
+                c = *m_cur++;
                 if (c == '\n') {
                     char buf[128];
                     std::sprintf(buf, "cuesheet: runaway string at line %u",
                                  m_lineno + 1);
                     throw std::runtime_error(buf);
                 } else if (c != '"')
-                    field.push_back(c);
-                else if (m_sb->sgetc() != '"') // closing quote
+                    *w++ = c;
+                else if (m_cur == m_end || *m_cur != '"') // closing quote
                     break;
                 else { // escaped quote
-                    m_sb->snextc();
-                    field.push_back(c);
+                    ++m_cur;
+                    *w++ = c;
                 }
             }
         }
         else if (c == '\n') {
             ++m_lineno;
+            eol = true;
             break;
         }
-        else if (std::strchr(" \r\t", c)) {
-            if (field.size()) {
-                m_fields.push_back(field);
-                field.clear();
+        else if (is_blank(c)) {
+            if (w > field) {
+                *w = 0;
+                m_fields.push_back(StringRef(field, w - field));
             }
-            while (std::strchr(" \r\t", m_sb->sgetc()))
-                m_sb->snextc();
+            while (m_cur < m_end && is_blank(*m_cur))
+                ++m_cur;
+            field = w = m_cur;
         }
         else
-            field.push_back(c);
+            *w++ = c;
+    }
+    if (w > field) {
+        *w = 0;
+        m_fields.push_back(StringRef(field, w - field));
     }
-    if (field.size()) m_fields.push_back(field);
-    return m_fields.size() > 0 || c == '\n';
+    return m_fields.size() > 0 || eol;
 }
 
-template struct CueTokenizer<char>;
+/*
+ * perfect hash of the commands handled by CueSheet::parse().
+ * other commands can share the slot, and are told by comparison.
+ */
+static inline unsigned command_hash(const StringRef &cmd)
+{
+    return (cmd.size + uint8_t(cmd.data[0])
+            + 8 * uint8_t(cmd.data[cmd.size - 1])) & 31;
+}
 
 void CueTrack::add_segment(const CueSegment &seg)
 {
@@ -105,11 +125,11 @@ void CueTrack::get_tags(std::map<std::string, std::string> *tags) const
     tags->swap(result);
 }
 
-void CueSheet::parse(std::streambuf *src)
+void CueSheet::parse(char *data, size_t size)
 {
     static struct handler_t {
         const char *cmd;
-        void (CueSheet::*mf)(const std::string *args);
+        void (CueSheet::*mf)(const StringRef *args);
         size_t nargs;
     } handlers[] = {
         { "FILE",       &CueSheet::parse_file,    3 },
@@ -125,26 +145,33 @@ void CueSheet::parse(std::streambuf *src)
         { "TITLE",      &CueSheet::parse_meta,    2 },
         { 0, 0, 0 }
     };
+    static const std::vector<const handler_t *> table = []() {
+        std::vector<const handler_t *> t(32);
+        for (const handler_t *p = handlers; p->cmd; ++p) {
+            unsigned h = command_hash(StringRef(p->cmd, std::strlen(p->cmd)));
+            if (t[h])
+                throw std::logic_error("cuesheet: command hash collision");
+            t[h] = p;
+        }
+        return t;
+    }();
 
-    CueTokenizer<char> tokenizer(src);
+    CueTokenizer tokenizer(data, size);
     while (tokenizer.nextline()) {
         if (!tokenizer.m_fields.size())
             continue;
         m_lineno = tokenizer.m_lineno;
-        std::string cmd = tokenizer.m_fields[0];
-        for (handler_t *p = handlers; p->cmd; ++p) {
-            if (cmd != p->cmd)
-                continue;
-            if (tokenizer.m_fields.size() == p->nargs)
-                (this->*p->mf)(&tokenizer.m_fields[0]);
-            else if (cmd != "REM") {
-                char msg[128];
-                std::sprintf(msg, "wrong num ars for %s command", p->cmd);
-                die(msg);
-            }
-            break;
+        const StringRef &cmd = tokenizer.m_fields[0];
+        const handler_t *p = table[command_hash(cmd)];
+        if (!p || cmd != p->cmd)
+            continue; // unknown command
+        if (tokenizer.m_fields.size() == p->nargs)
+            (this->*p->mf)(&tokenizer.m_fields[0]);
+        else if (cmd != "REM") {
+            char msg[128];
+            std::sprintf(msg, "wrong num ars for %s command", p->cmd);
+            die(msg);
         }
-        // if (!p->cmd) die("Unknown command");
     }
     validate();
 }
@@ -154,26 +181,43 @@ void CueSheet::as_chapters(double duration,
 {
     if (m_has_multiple_files)
         throw std::runtime_error("Multiple FILE present in cuesheet");
+    if (m_files.size())
+        as_chapters(m_files[0], duration, chapters);
+    else
+        chapters->clear();
+}
 
+void CueSheet::as_chapters(const std::string &filename, double duration,
+                           std::vector<chapter_entry_t> *chapters) const
+{
     std::vector<chapter_entry_t> chaps;
     unsigned tbeg, tend, last_end = 0;
-    std::for_each(begin(), end(), [&](const CueTrack &track) {
-        tbeg = track.begin()->m_begin;
-        tend = track.begin()->m_end;
+    for (auto track = begin(); track != end(); ++track) {
+        if (track->filename() != filename)
+            continue;
+        /* the first track in the FILE starts from the beginning of it */
+        tbeg = chaps.size() ? track->begin()->m_begin : 0;
+        tend = track->begin()->m_end;
+        /* the last track in the FILE extends to the end of it */
+        auto next = track + 1;
+        while (next != end() && next->filename() != filename)
+            ++next;
+        if (next == end())
+            tend = ~0U;
         double track_duration;
         if (tend != ~0U)
             track_duration = (tend - tbeg) / 75.0;
         else
             track_duration = duration - (last_end / 75.0);
-        std::string title = track.name();
+        std::string title = track->name();
         if (title == "") {
             char buf[64];
-            std::sprintf(buf, "Track %02d", track.number());
+            std::sprintf(buf, "Track %02d", track->number());
             title = buf;
         }
         chaps.push_back(std::make_pair(track_duration, title));
         last_end = tend;
-    });
+    }
     chapters->swap(chaps);
 }
 
@@ -223,31 +267,34 @@ void CueSheet::validate()
     };
 }
 
-void CueSheet::parse_file(const std::string *args)
+void CueSheet::parse_file(const StringRef *args)
 {
-    if (!m_cur_file.empty() && m_cur_file != args[1])
+    std::string filename = args[1].str();
+    if (!m_cur_file.empty() && m_cur_file != filename)
         this->m_has_multiple_files = true;
-    m_cur_file = args[1];
+    m_cur_file = filename;
+    if (std::find(m_files.begin(), m_files.end(), m_cur_file) == m_files.end())
+        m_files.push_back(m_cur_file);
 }
-void CueSheet::parse_track(const std::string *args)
+void CueSheet::parse_track(const StringRef *args)
 {
     if (args[2] == "AUDIO") {
         unsigned no;
-        if (std::sscanf(args[1].c_str(), "%d", &no) != 1)
+        if (std::sscanf(args[1].data, "%d", &no) != 1)
             die("Invalid TRACK number");
         m_tracks.push_back(CueTrack(this, no));
     }
 }
-void CueSheet::parse_index(const std::string *args)
+void CueSheet::parse_index(const StringRef *args)
 {
     if (!m_tracks.size())
         die("INDEX command before TRACK");
     if (m_cur_file.empty())
         die("INDEX command before FILE");
     unsigned no, mm, ss, ff, nframes;
-    if (std::sscanf(args[1].c_str(), "%u", &no) != 1)
+    if (std::sscanf(args[1].data, "%u", &no) != 1)
         die("Invalid INDEX number");
-    if (std::sscanf(args[2].c_str(), "%u:%u:%u", &mm, &ss, &ff) != 3)
+    if (std::sscanf(args[2].data, "%u:%u:%u", &mm, &ss, &ff) != 3)
         die("Invalid INDEX time format");
     if (ss > 59 || ff > 74)
         die("Invalid INDEX time format");
@@ -273,33 +320,33 @@ void CueSheet::parse_index(const std::string *args)
         m_tracks[m_tracks.size() - 2].add_segment(segment);
     }
 }
-void CueSheet::parse_postgap(const std::string *args)
+void CueSheet::parse_postgap(const StringRef *args)
 {
     if (!m_tracks.size())
         die("POSTGAP command before TRACK");
     unsigned mm, ss, ff;
-    if (std::sscanf(args[1].c_str(), "%u:%u:%u", &mm, &ss, &ff) != 3)
+    if (std::sscanf(args[1].data, "%u:%u:%u", &mm, &ss, &ff) != 3)
         die("Invalid POSTGAP time format");
     CueSegment segment(std::string("__GAP__"), 0x7ffffffe);
     segment.m_end = msf2frames(mm, ss, ff);
     m_tracks.back().add_segment(segment);
 }
-void CueSheet::parse_pregap(const std::string *args)
+void CueSheet::parse_pregap(const StringRef *args)
 {
     if (!m_tracks.size())
         die("PREGAP command before TRACK");
     unsigned mm, ss, ff;
-    if (std::sscanf(args[1].c_str(), "%u:%u:%u", &mm, &ss, &ff) != 3)
+    if (std::sscanf(args[1].data, "%u:%u:%u", &mm, &ss, &ff) != 3)
         die("Invalid PREGAP time format");
     CueSegment segment(std::string("__GAP__"), 0x7fffffff);
     segment.m_end = msf2frames(mm, ss, ff);
     if (m_tracks.size() > 1)
         m_tracks[m_tracks.size() - 2].add_segment(segment);
 }
-void CueSheet::parse_meta(const std::string *args)
+void CueSheet::parse_meta(const StringRef *args)
 {
     if (m_tracks.size())
-        m_tracks.back().set_meta(args[0], args[1]);
+        m_tracks.back().set_meta(args[0].str(), args[1].str());
     else
-        m_meta[args[0]] = args[1];
+        m_meta[args[0].str()] = args[1].str();
 }
@@ -1,22 +1,39 @@
-#include <streambuf>
-#include <istream>
+#include <cstring>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <map>
 
-template <typename CharT>
-struct CueTokenizer {
-    typedef std::char_traits<CharT> traits_type;
-    typedef typename traits_type::int_type int_type;
+/* reference to a string in the buffer being parsed */
+struct StringRef {
+    const char *data;
+    size_t size;
+
+    StringRef(): data(""), size(0) {}
+    StringRef(const char *p, size_t n): data(p), size(n) {}
+    std::string str() const { return std::string(data, size); }
+    bool operator==(const char *s) const
+    {
+        return std::strlen(s) == size && !std::memcmp(data, s, size);
+    }
+    bool operator!=(const char *s) const { return !(*this == s); }
+};
 
-    explicit CueTokenizer(std::basic_streambuf<CharT> *sb)
-        : m_sb(sb), m_lineno(0)
+/*
+ * splits lines of cuesheet into fields, in place.
+ * quotes are removed (unescaped in place), and each field is nul
+ * terminated, so the buffer must be writable, and nul terminated at
+ * data[size] (as std::string is).
+ */
+struct CueTokenizer {
+    CueTokenizer(char *data, size_t size)
+        : m_cur(data), m_end(data + size), m_lineno(0)
     {}
     bool nextline();
 
-    std::basic_streambuf<CharT> *m_sb;
-    std::vector<std::basic_string<CharT> > m_fields;
+    char *m_cur, *m_end;
+    std::vector<StringRef> m_fields;
     unsigned m_lineno;
 };
 
@@ -49,6 +66,11 @@ public:
         return p == m_meta.end() ? "" : p->second;
     }
     unsigned number() const { return m_number; }
+    /* FILE where the track starts */
+    const std::string &filename() const
+    {
+        return m_segments.front().m_filename;
+    }
     void add_segment(const CueSegment &seg);
     void set_meta(const std::string &key, const std::string &value)
     {
@@ -70,6 +92,7 @@ class CueSheet {
     bool m_has_multiple_files;
     size_t m_lineno;
     std::string m_cur_file;
+    std::vector<std::string> m_files;
     std::vector<CueTrack> m_tracks;
     std::map<std::string, std::string> m_meta;
 public:
@@ -78,9 +101,18 @@ public:
     typedef std::pair<double, std::string> chapter_entry_t;
 
     CueSheet(): m_has_multiple_files(false) {}
-    void parse(std::streambuf *src);
+    /* data is modified by the tokenizer. see CueTokenizer */
+    void parse(char *data, size_t size);
     void as_chapters(double duration, /* total duration in sec. */
                      std::vector<chapter_entry_t> *chapters) const;
+    /*
+     * chapters for the tracks starting in the given FILE.
+     * duration is that of the FILE.
+     */
+    void as_chapters(const std::string &filename, double duration,
+                     std::vector<chapter_entry_t> *chapters) const;
+    /* FILEs in the order of appearance */
+    const std::vector<std::string> &files() const { return m_files; }
     void get_tags(std::map<std::string, std::string> *tags) const;
 
     unsigned count() const { return m_tracks.size(); }
@@ -90,13 +122,13 @@ public:
     const_iterator end() const { return m_tracks.end(); }
 private:
     void validate();
-    void parse_file(const std::string *args);
-    void parse_track(const std::string *args);
-    void parse_index(const std::string *args);
-    void parse_postgap(const std::string *args);
-    void parse_pregap(const std::string *args);
-    void parse_meta(const std::string *args);
-    void parse_rem(const std::string *args) { parse_meta(args + 1); }
+    void parse_file(const StringRef *args);
+    void parse_track(const StringRef *args);
+    void parse_index(const StringRef *args);
+    void parse_postgap(const StringRef *args);
+    void parse_pregap(const StringRef *args);
+    void parse_meta(const StringRef *args);
+    void parse_rem(const StringRef *args) { parse_meta(args + 1); }
     void die(const std::string &msg)
     {
         std::stringstream ss;
@@ -0,0 +1,263 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include "json.h"
+
+std::string json_quote(const std::string &s)
+{
+    std::string result("\"");
+    for (auto p = s.begin(); p != s.end(); ++p) {
+        unsigned char c = *p;
+        switch (c) {
+        case '"':  result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\b': result += "\\b";  break;
+        case '\f': result += "\\f";  break;
+        case '\n': result += "\\n";  break;
+        case '\r': result += "\\r";  break;
+        case '\t': result += "\\t";  break;
+        default:
+            if (c < 0x20) {
+                char buf[8];
+                std::sprintf(buf, "\\u%04x", c);
+                result += buf;
+            } else
+                result.push_back(c);
+        }
+    }
+    result.push_back('"');
+    return result;
+}
+
+std::string fnv1a_hex(const void *data, size_t size)
+{
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    char buf[32];
+    std::sprintf(buf, "%016llx", static_cast<unsigned long long>(h));
+    return buf;
+}
+
+std::string fnv1a_hex(const std::string &s)
+{
+    return fnv1a_hex(s.data(), s.size());
+}
+
+std::string json_number(int64_t n)
+{
+    char buf[32];
+    std::sprintf(buf, "%lld", static_cast<long long>(n));
+    return buf;
+}
+
+std::string json_number(uint64_t n)
+{
+    char buf[32];
+    std::sprintf(buf, "%llu", static_cast<unsigned long long>(n));
+    return buf;
+}
+
+std::string json_number(double n)
+{
+    char buf[64];
+    std::sprintf(buf, "%.15g", n);
+    return buf;
+}
+
+const JSONValue *JSONValue::get(const std::string &key) const
+{
+    for (auto m = m_members.begin(); m != m_members.end(); ++m)
+        if (m->first == key)
+            return &m->second;
+    return 0;
+}
+
+class JSONParser {
+    const char *m_begin, *m_cur, *m_end;
+public:
+    JSONParser(const std::string &text)
+        : m_begin(text.data()), m_cur(text.data()),
+          m_end(text.data() + text.size())
+    {}
+    JSONValue parse()
+    {
+        JSONValue value = parse_value();
+        skip_ws();
+        if (m_cur != m_end)
+            die("garbage after value");
+        return value;
+    }
+private:
+    void die(const char *msg)
+    {
+        char buf[128];
+        std::sprintf(buf, "JSON: %s at offset %u", msg,
+                     unsigned(m_cur - m_begin));
+        throw std::runtime_error(buf);
+    }
+    void skip_ws()
+    {
+        while (m_cur < m_end && std::strchr(" \t\r\n", *m_cur))
+            ++m_cur;
+    }
+    bool consume(const char *token)
+    {
+        size_t len = std::strlen(token);
+        if (size_t(m_end - m_cur) < len || std::memcmp(m_cur, token, len))
+            return false;
+        m_cur += len;
+        return true;
+    }
+    JSONValue parse_value()
+    {
+        JSONValue value;
+        skip_ws();
+        if (m_cur == m_end)
+            die("unexpected end of input");
+        if (*m_cur == '{') {
+            value.m_type = JSONValue::OBJECT;
+            ++m_cur;
+            skip_ws();
+            if (m_cur < m_end && *m_cur == '}') {
+                ++m_cur;
+                return value;
+            }
+            do {
+                skip_ws();
+                if (m_cur == m_end || *m_cur != '"')
+                    die("object key expected");
+                std::string key = parse_string();
+                skip_ws();
+                if (!consume(":"))
+                    die("':' expected");
+                JSONValue member = parse_value();
+                value.m_members.push_back(std::make_pair(key, member));
+                skip_ws();
+            } while (consume(","));
+            if (!consume("}"))
+                die("'}' expected");
+        } else if (*m_cur == '[') {
+            value.m_type = JSONValue::ARRAY;
+            ++m_cur;
+            skip_ws();
+            if (m_cur < m_end && *m_cur == ']') {
+                ++m_cur;
+                return value;
+            }
+            do {
+                value.m_elements.push_back(parse_value());
+                skip_ws();
+            } while (consume(","));
+            if (!consume("]"))
+                die("']' expected");
+        } else if (*m_cur == '"') {
+            value.m_type = JSONValue::STRING;
+            value.m_string = parse_string();
+        } else if (consume("true")) {
+            value.m_type = JSONValue::BOOLEAN;
+            value.m_bool = true;
+        } else if (consume("false")) {
+            value.m_type = JSONValue::BOOLEAN;
+        } else if (consume("null")) {
+            value.m_type = JSONValue::NUL;
+        } else {
+            value.m_type = JSONValue::NUMBER;
+            std::string token;
+            while (m_cur < m_end && std::strchr("+-.0123456789eE", *m_cur))
+                token.push_back(*m_cur++);
+            char *endp;
+            value.m_number = std::strtod(token.c_str(), &endp);
+            if (token.empty() || *endp)
+                die("invalid value");
+        }
+        return value;
+    }
+    unsigned parse_hex4()
+    {
+        if (m_end - m_cur < 4)
+            die("truncated \\u escape");
+        unsigned n = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = *m_cur++;
+            n <<= 4;
+            if (c >= '0' && c <= '9')      n |= c - '0';
+            else if (c >= 'a' && c <= 'f') n |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') n |= c - 'A' + 10;
+            else die("invalid \\u escape");
+        }
+        return n;
+    }
+    std::string parse_string()
+    {
+        std::string result;
+        ++m_cur; /* opening quote */
+        for (;;) {
+            if (m_cur == m_end)
+                die("unterminated string");
+            char c = *m_cur++;
+            if (c == '"')
+                break;
+            if (c != '\\') {
+                result.push_back(c);
+                continue;
+            }
+            if (m_cur == m_end)
+                die("unterminated string");
+            switch (c = *m_cur++) {
+            case 'b': result.push_back('\b'); break;
+            case 'f': result.push_back('\f'); break;
+            case 'n': result.push_back('\n'); break;
+            case 'r': result.push_back('\r'); break;
+            case 't': result.push_back('\t'); break;
+            case 'u':
+                {
+                    unsigned cp = parse_hex4();
+                    if (cp >= 0xd800 && cp < 0xdc00 && consume("\\u")) {
+                        unsigned lo = parse_hex4();
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    }
+                    append_utf8(cp, &result);
+                }
+                break;
+            default:
+                result.push_back(c);
+            }
+        }
+        return result;
+    }
+    static void append_utf8(unsigned cp, std::string *s)
+    {
+        if (cp < 0x80)
+            s->push_back(cp);
+        else if (cp < 0x800) {
+            s->push_back(0xc0 | (cp >> 6));
+            s->push_back(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            s->push_back(0xe0 | (cp >> 12));
+            s->push_back(0x80 | ((cp >> 6) & 0x3f));
+            s->push_back(0x80 | (cp & 0x3f));
+        } else {
+            s->push_back(0xf0 | (cp >> 18));
+            s->push_back(0x80 | ((cp >> 12) & 0x3f));
+            s->push_back(0x80 | ((cp >> 6) & 0x3f));
+            s->push_back(0x80 | (cp & 0x3f));
+        }
+    }
+};
+
+JSONValue JSONValue::parse(const std::string &text)
+{
+    return JSONParser(text).parse();
+}
@@ -0,0 +1,59 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef JSON_H
+#define JSON_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+
+/*
+ * minimal helpers for emitting JSON.
+ * strings are assumed to be UTF-8, and are emitted as is except for
+ * characters that have to be escaped.
+ */
+std::string json_quote(const std::string &s);
+std::string json_number(int64_t n);
+std::string json_number(uint64_t n);
+std::string json_number(double n);
+
+/* 64-bit FNV-1a hash of data, in 16 hex digits (not for security) */
+std::string fnv1a_hex(const void *data, size_t size);
+std::string fnv1a_hex(const std::string &s);
+
+/*
+ * parsed JSON value.
+ * object members are kept in the order of appearance.
+ */
+class JSONValue {
+public:
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+    typedef std::pair<std::string, JSONValue> member_t;
+
+    JSONValue(): m_type(NUL), m_bool(false), m_number(0.0) {}
+    Type type() const { return m_type; }
+    bool is_null() const { return m_type == NUL; }
+    bool as_bool() const { return m_bool; }
+    double as_number() const { return m_number; }
+    const std::string &as_string() const { return m_string; }
+    const std::vector<JSONValue> &elements() const { return m_elements; }
+    const std::vector<member_t> &members() const { return m_members; }
+    /* returns 0 when not an object, or key is not found */
+    const JSONValue *get(const std::string &key) const;
+
+    /* throws std::runtime_error on malformed input */
+    static JSONValue parse(const std::string &text);
+private:
+    friend class JSONParser;
+    Type m_type;
+    bool m_bool;
+    double m_number;
+    std::string m_string;
+    std::vector<JSONValue> m_elements;
+    std::vector<member_t> m_members;
+};
+
+#endif
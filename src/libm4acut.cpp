@@ -0,0 +1,578 @@
+/*
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <string>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# if HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+# endif
+#endif
+#include "m4acut.h"
+#include "M4ATrimmer.h"
+#include "WorkerPool.h"
+#include "compat.h"
+#include "die.h"
+#include "version.h"
+
+struct m4acut_input {
+    std::shared_ptr<M4ATrimmer> trimmer;
+};
+
+struct m4acut_session {
+    std::shared_ptr<M4ATrimmer> input;
+    M4ATrimmer trimmer;
+    std::atomic<bool> busy;  /* has a running job */
+
+    m4acut_session(): busy(false) {}
+};
+
+namespace {
+
+/* progress and cancel request of a write */
+struct WriteState {
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> total;
+    std::atomic<bool> cancel;
+
+    WriteState(): written(0), total(0), cancel(false) {}
+};
+
+struct Cancelled: std::runtime_error {
+    Cancelled(): std::runtime_error("cancelled") {}
+};
+
+thread_local std::string last_error;
+
+int fail(int code, const std::string &msg)
+{
+    last_error = msg;
+    return code;
+}
+
+/*
+ * run f, translating exceptions into code.
+ * bad_alloc is always reported as M4ACUT_ERROR_NO_MEMORY.
+ */
+template <typename F>
+int guard(int code, F f)
+{
+    try {
+        f();
+        return M4ACUT_OK;
+    } catch (const std::bad_alloc &) {
+        return fail(M4ACUT_ERROR_NO_MEMORY, "out of memory");
+    } catch (const Cancelled &e) {
+        return fail(M4ACUT_ERROR_CANCELLED, e.what());
+    } catch (const std::exception &e) {
+        return fail(code, e.what());
+    }
+}
+
+int invalid_argument()
+{
+    return fail(M4ACUT_ERROR_INVALID_ARGUMENT, "invalid argument");
+}
+
+int session_busy()
+{
+    return fail(M4ACUT_ERROR_BUSY, "session has a running job");
+}
+
+/*
+ * write the selected range into the file, or through io when given.
+ * output is closed even on failure, so that the sink can be released.
+ */
+void write_output(M4ATrimmer &trimmer, const std::string &name,
+                  const OutputIO *io, WriteState *state=0)
+{
+    try {
+        if (state && state->cancel)
+            throw Cancelled();
+        if (io)
+            trimmer.open_output(name, *io);
+        else
+            trimmer.open_output(name);
+        if (state)
+            state->total = trimmer.num_access_units();
+        while (trimmer.copy_next_access_unit()) {
+            if (!state)
+                continue;
+            if (state->cancel)
+                throw Cancelled();
+            ++state->written;
+        }
+        trimmer.finish_write(0, 0);
+    } catch (...) {
+        trimmer.close_output();
+        throw;
+    }
+    trimmer.close_output();
+}
+
+/*
+ * write into a temporary next to the file, and rename it on success,
+ * so that an existing file is left untouched on failure.
+ */
+void write_file(M4ATrimmer &trimmer, const std::string &name,
+                WriteState *state=0)
+{
+    std::string tmpname = name + ".m4acut-tmp";
+    try {
+        write_output(trimmer, tmpname, 0, state);
+    } catch (...) {
+        aa_unlink(tmpname.c_str());
+        throw;
+    }
+    if (aa_rename(tmpname.c_str(), name.c_str())) {
+        int err = errno;
+        aa_unlink(tmpname.c_str());
+        throw_file_error(name, std::strerror(err));
+    }
+}
+
+/* growable buffer for m4acut_session_write_memory() */
+struct MemorySink {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    size_t pos;
+
+    static int read(void *opaque, uint8_t *buf, int size)
+    {
+        MemorySink *self = static_cast<MemorySink*>(opaque);
+        size_t n = self->pos < self->size ? self->size - self->pos : 0;
+        if (n > size_t(size))
+            n = size;
+        std::memcpy(buf, self->data + self->pos, n);
+        self->pos += n;
+        return int(n);
+    }
+    static int write(void *opaque, uint8_t *buf, int size)
+    {
+        MemorySink *self = static_cast<MemorySink*>(opaque);
+        size_t end = self->pos + size;
+        if (end > self->capacity) {
+            size_t capacity = std::max<size_t>(end, self->capacity * 2);
+            void *p = std::realloc(self->data, capacity);
+            if (!p)
+                return -1;
+            self->data = static_cast<uint8_t*>(p);
+            self->capacity = capacity;
+        }
+        /* seek beyond the end leaves a hole */
+        if (self->pos > self->size)
+            std::memset(self->data + self->size, 0, self->pos - self->size);
+        std::memcpy(self->data + self->pos, buf, size);
+        self->pos = end;
+        if (end > self->size)
+            self->size = end;
+        return size;
+    }
+    static int64_t seek(void *opaque, int64_t offset, int whence)
+    {
+        MemorySink *self = static_cast<MemorySink*>(opaque);
+        int64_t base = whence == SEEK_SET ? 0
+                     : whence == SEEK_CUR ? int64_t(self->pos)
+                     : int64_t(self->size);
+        if (base + offset < 0)
+            return -1;
+        self->pos = size_t(base + offset);
+        return self->pos;
+    }
+};
+
+/* pool for asynchronous jobs, started on first use */
+WorkerPool &job_pool()
+{
+    static WorkerPool pool(WorkerPool::default_concurrency());
+    return pool;
+}
+
+} // end of empty namespace
+
+struct m4acut_job {
+    m4acut_session *session;
+    std::string filename;
+    bool has_io;
+    OutputIO io;
+    m4acut_job_callback callback;
+    void *opaque;
+    WriteState state;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool finished;
+    bool returned;  /* run() no longer touches the job */
+    bool freed;     /* m4acut_job_free() was called before returned */
+    int status;
+    std::string error;
+    int fd[2];  /* eventfd has only fd[0] */
+
+    m4acut_job(): session(0), has_io(false), callback(0), opaque(0),
+                  finished(false), returned(false), freed(false),
+                  status(M4ACUT_OK)
+    {
+        std::memset(&io, 0, sizeof io);
+        fd[0] = fd[1] = -1;
+#if HAVE_SYS_EVENTFD_H
+        fd[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#elif !defined(_WIN32)
+        if (pipe(fd) == 0) {
+            fcntl(fd[0], F_SETFL, O_NONBLOCK);
+            fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+            fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+        }
+#endif
+    }
+    ~m4acut_job()
+    {
+#ifndef _WIN32
+        if (fd[0] >= 0) close(fd[0]);
+        if (fd[1] >= 0) close(fd[1]);
+#endif
+    }
+    void notify_fd()
+    {
+#if HAVE_SYS_EVENTFD_H
+        uint64_t one = 1;
+        if (fd[0] >= 0 && write(fd[0], &one, sizeof one) < 0) {}
+#elif !defined(_WIN32)
+        if (fd[1] >= 0 && write(fd[1], "", 1) < 0) {}
+#endif
+    }
+    void run()
+    {
+        int rc = guard(M4ACUT_ERROR_IO, [&]() {
+            if (has_io)
+                write_output(session->trimmer, filename, &io, &state);
+            else
+                write_file(session->trimmer, filename, &state);
+        });
+        session->busy = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            status = rc;
+            if (rc != M4ACUT_OK)
+                error = last_error;
+            finished = true;
+            cond.notify_all();
+        }
+        notify_fd();
+        if (callback)
+            callback(opaque, this, rc);
+        /* the job is released here when freed during the callback */
+        bool release;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            release = freed;
+            returned = true;
+        }
+        if (release)
+            delete this;
+    }
+private:
+    m4acut_job(const m4acut_job &);
+    m4acut_job &operator=(const m4acut_job &);
+};
+
+namespace {
+
+int start_job(m4acut_session *session, const char *filename,
+              const m4acut_io *io, m4acut_job_callback callback,
+              void *opaque, m4acut_job **job)
+{
+    bool expected = false;
+    if (!session->busy.compare_exchange_strong(expected, true))
+        return session_busy();
+    return guard(M4ACUT_ERROR_FAILED, [&]() {
+        std::unique_ptr<m4acut_job> j;
+        try {
+            j.reset(new m4acut_job());
+            j->session  = session;
+            j->callback = callback;
+            j->opaque   = opaque;
+            if (filename)
+                j->filename = filename;
+            else {
+                OutputIO oio = { io->opaque, io->read, io->write, io->seek };
+                j->filename = "<io>";
+                j->has_io   = true;
+                j->io       = oio;
+            }
+            m4acut_job *p = j.get();
+            job_pool().submit([p]() { p->run(); });
+        } catch (...) {
+            session->busy = false;
+            throw;
+        }
+        *job = j.release();
+    });
+}
+
+} // end of empty namespace
+
+extern "C" {
+
+const char *m4acut_get_version(void)
+{
+    return m4acut_version;
+}
+
+const char *m4acut_last_error(void)
+{
+    return last_error.c_str();
+}
+
+int m4acut_input_open(const char *filename, m4acut_input **input)
+{
+    if (!filename || !input)
+        return invalid_argument();
+    FILE *fp = aa_fopen(filename, "rb");
+    if (!fp)
+        return fail(M4ACUT_ERROR_IO,
+                    std::string(std::strerror(errno)) + ": " + filename);
+    std::fclose(fp);
+
+    return guard(M4ACUT_ERROR_FORMAT, [&]() {
+        std::shared_ptr<M4ATrimmer> trimmer = std::make_shared<M4ATrimmer>();
+        trimmer->open_input(filename);
+        *input = new m4acut_input();
+        (*input)->trimmer = trimmer;
+    });
+}
+
+void m4acut_input_close(m4acut_input *input)
+{
+    delete input;
+}
+
+int m4acut_input_get_info(const m4acut_input *input, m4acut_input_info *info)
+{
+    if (!input || !info)
+        return invalid_argument();
+    const M4ATrimmer &t = *input->trimmer;
+    info->sample_rate  = t.sample_rate();
+    info->duration     = uint64_t(double(t.duration()) * t.sample_rate()
+                                  / t.timescale() + .5);
+    info->num_chapters = unsigned(t.chapters().size());
+    return M4ACUT_OK;
+}
+
+int m4acut_input_get_chapter(const m4acut_input *input, unsigned index,
+                             double *start, const char **title)
+{
+    if (!input)
+        return invalid_argument();
+    auto &chapters = input->trimmer->chapters();
+    if (index >= chapters.size())
+        return fail(M4ACUT_ERROR_RANGE, "chapter index out of range");
+    if (start)
+        *start = chapters[index].first;
+    if (title)
+        *title = chapters[index].second.c_str();
+    return M4ACUT_OK;
+}
+
+int m4acut_session_new(m4acut_input *input, m4acut_session **session)
+{
+    if (!input || !session)
+        return invalid_argument();
+    return guard(M4ACUT_ERROR_FAILED, [&]() {
+        std::unique_ptr<m4acut_session> s(new m4acut_session());
+        s->input = input->trimmer;
+        s->trimmer.open_input(*s->input);
+        *session = s.release();
+    });
+}
+
+void m4acut_session_free(m4acut_session *session)
+{
+    delete session;
+}
+
+int m4acut_session_select_ranges(m4acut_session *session,
+                                 const m4acut_range *ranges, size_t count)
+{
+    if (!session || (count && !ranges))
+        return invalid_argument();
+    if (session->busy)
+        return session_busy();
+    return guard(M4ACUT_ERROR_RANGE, [&]() {
+        std::vector<TimeRange> spec(count);
+        for (size_t i = 0; i < count; ++i) {
+            spec[i].first.is_samples  = spec[i].second.is_samples  = true;
+            spec[i].first.value.samples  = ranges[i].start;
+            spec[i].second.value.samples = ranges[i].end;
+        }
+        session->trimmer.select_cut_ranges(spec);
+    });
+}
+
+int m4acut_session_select_chapter(m4acut_session *session, unsigned index)
+{
+    if (!session)
+        return invalid_argument();
+    if (session->busy)
+        return session_busy();
+    return guard(M4ACUT_ERROR_RANGE, [&]() {
+        session->trimmer.select_chapter(index);
+    });
+}
+
+int m4acut_session_set_tag(m4acut_session *session, const char *name,
+                           const char *value)
+{
+    if (!session || !name || !value)
+        return invalid_argument();
+    if (session->busy)
+        return session_busy();
+    return guard(M4ACUT_ERROR_FAILED, [&]() {
+        session->trimmer.set_tag(name, value);
+    });
+}
+
+int m4acut_session_write_file(m4acut_session *session, const char *filename)
+{
+    if (!session || !filename)
+        return invalid_argument();
+    if (session->busy)
+        return session_busy();
+    return guard(M4ACUT_ERROR_IO, [&]() {
+        write_file(session->trimmer, filename);
+    });
+}
+
+int m4acut_session_write_memory(m4acut_session *session,
+                                uint8_t **data, size_t *size)
+{
+    if (!session || !data || !size)
+        return invalid_argument();
+    if (session->busy)
+        return session_busy();
+    MemorySink sink = { 0, 0, 0, 0 };
+    OutputIO io = { &sink, MemorySink::read, MemorySink::write,
+                    MemorySink::seek };
+    int rc = guard(M4ACUT_ERROR_IO, [&]() {
+        write_output(session->trimmer, "<memory>", &io);
+    });
+    if (rc == M4ACUT_OK) {
+        *data = sink.data;
+        *size = sink.size;
+    } else
+        std::free(sink.data);
+    return rc;
+}
+
+int m4acut_session_write_io(m4acut_session *session, const m4acut_io *io)
+{
+    if (!session || !io || !io->read || !io->write || !io->seek)
+        return invalid_argument();
+    if (session->busy)
+        return session_busy();
+    OutputIO oio = { io->opaque, io->read, io->write, io->seek };
+    return guard(M4ACUT_ERROR_IO, [&]() {
+        write_output(session->trimmer, "<io>", &oio);
+    });
+}
+
+void m4acut_free(void *data)
+{
+    std::free(data);
+}
+
+int m4acut_session_write_file_async(m4acut_session *session,
+                                    const char *filename,
+                                    m4acut_job_callback callback,
+                                    void *opaque, m4acut_job **job)
+{
+    if (!session || !filename || !job)
+        return invalid_argument();
+    return start_job(session, filename, 0, callback, opaque, job);
+}
+
+int m4acut_session_write_io_async(m4acut_session *session,
+                                  const m4acut_io *io,
+                                  m4acut_job_callback callback,
+                                  void *opaque, m4acut_job **job)
+{
+    if (!session || !io || !io->read || !io->write || !io->seek || !job)
+        return invalid_argument();
+    return start_job(session, 0, io, callback, opaque, job);
+}
+
+int m4acut_job_get_fd(const m4acut_job *job)
+{
+    return job ? job->fd[0] : -1;
+}
+
+double m4acut_job_get_progress(const m4acut_job *job)
+{
+    if (!job)
+        return 0.0;
+    uint64_t total = job->state.total;
+    return total ? double(job->state.written) / total : 0.0;
+}
+
+void m4acut_job_cancel(m4acut_job *job)
+{
+    if (job)
+        job->state.cancel = true;
+}
+
+int m4acut_job_is_finished(m4acut_job *job)
+{
+    if (!job)
+        return 0;
+    std::lock_guard<std::mutex> lock(job->mutex);
+    return job->finished;
+}
+
+int m4acut_job_wait(m4acut_job *job)
+{
+    if (!job)
+        return invalid_argument();
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cond.wait(lock, [job]() { return job->finished; });
+    return job->status;
+}
+
+const char *m4acut_job_get_error(m4acut_job *job)
+{
+    if (!job)
+        return "";
+    std::lock_guard<std::mutex> lock(job->mutex);
+    return job->error.c_str();
+}
+
+void m4acut_job_free(m4acut_job *job)
+{
+    if (!job)
+        return;
+    m4acut_job_cancel(job);
+    m4acut_job_wait(job);
+    /* otherwise, the callback is still running, and run() releases it */
+    bool release;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        release = job->returned;
+        job->freed = true;
+    }
+    if (release)
+        delete job;
+}
+
+} // extern "C"
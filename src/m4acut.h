@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+#ifndef M4ACUT_H
+#define M4ACUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libm4acut: lossless and gapless cut of M4A files.
+ *
+ * An input is parsed once by m4acut_input_open(), and can be shared by
+ * sessions on any number of threads. A session selects a part of the
+ * input, sets tags, and writes one output at a time.
+ * A session must not be used by multiple threads at the same time.
+ *
+ * Functions return M4ACUT_OK or a negative error code.
+ * Message of the last error on the calling thread is available by
+ * m4acut_last_error().
+ */
+
+typedef enum m4acut_status {
+    M4ACUT_OK                     =  0,
+    M4ACUT_ERROR_INVALID_ARGUMENT = -1,
+    M4ACUT_ERROR_NO_MEMORY        = -2,
+    M4ACUT_ERROR_IO               = -3,  /* cannot open, read or write */
+    M4ACUT_ERROR_FORMAT           = -4,  /* not a supported M4A file */
+    M4ACUT_ERROR_RANGE            = -5,  /* invalid range or chapter */
+    M4ACUT_ERROR_FAILED           = -6,  /* other failures */
+    M4ACUT_ERROR_CANCELLED        = -7,
+    M4ACUT_ERROR_BUSY             = -8   /* session has a running job */
+} m4acut_status;
+
+typedef struct m4acut_input m4acut_input;
+typedef struct m4acut_session m4acut_session;
+typedef struct m4acut_job m4acut_job;
+
+typedef struct m4acut_input_info {
+    uint32_t sample_rate;
+    uint64_t duration;      /* in samples, excluding priming/padding */
+    unsigned num_chapters;
+} m4acut_input_info;
+
+/* range in samples at the sample rate of input. end 0: end of input */
+typedef struct m4acut_range {
+    uint64_t start;
+    uint64_t end;
+} m4acut_range;
+
+/*
+ * sink for the output, in the same manner as stdio.
+ * read() returns number of bytes read, 0 on EOF, negative on error.
+ * write() returns number of bytes written, negative on error.
+ * seek() returns new position, negative on error.
+ * read and seek are needed for placing moov in front of mdat.
+ */
+typedef struct m4acut_io {
+    void *opaque;
+    int (*read)(void *opaque, uint8_t *buf, int size);
+    int (*write)(void *opaque, uint8_t *buf, int size);
+    int64_t (*seek)(void *opaque, int64_t offset, int whence);
+} m4acut_io;
+
+const char *m4acut_get_version(void);
+const char *m4acut_last_error(void);
+
+/* input is read-only, and thread-safe */
+int m4acut_input_open(const char *filename, m4acut_input **input);
+/* sessions opened from the input keep it alive */
+void m4acut_input_close(m4acut_input *input);
+int m4acut_input_get_info(const m4acut_input *input, m4acut_input_info *info);
+/* title is valid while input is open */
+int m4acut_input_get_chapter(const m4acut_input *input, unsigned index,
+                             double *start, const char **title);
+
+int m4acut_session_new(m4acut_input *input, m4acut_session **session);
+void m4acut_session_free(m4acut_session *session);
+/*
+ * select ranges to be kept in the output.
+ * ranges must be in ascending order, and must not overlap.
+ */
+int m4acut_session_select_ranges(m4acut_session *session,
+                                 const m4acut_range *ranges, size_t count);
+/* select nth chapter (0 origin), setting title and track number tags */
+int m4acut_session_select_chapter(m4acut_session *session, unsigned index);
+/*
+ * tags of the input are carried over. name is as in cuesheet:
+ * ALBUM, ALBUMARTIST, ARTIST, DATE, DISC, GENRE, SONGWRITER, TITLE, TRACK.
+ */
+int m4acut_session_set_tag(m4acut_session *session, const char *name,
+                           const char *value);
+
+/* existing file is replaced only on success */
+int m4acut_session_write_file(m4acut_session *session, const char *filename);
+/* *data has to be released by m4acut_free() */
+int m4acut_session_write_memory(m4acut_session *session,
+                                uint8_t **data, size_t *size);
+int m4acut_session_write_io(m4acut_session *session, const m4acut_io *io);
+void m4acut_free(void *data);
+
+/*
+ * asynchronous writing.
+ * the job runs on a thread pool of the library, and the session must
+ * not be touched until the job is finished.
+ *
+ * completion is notified by the descriptor of m4acut_job_get_fd(),
+ * which becomes readable, and by the callback (called on the worker
+ * thread after the job is marked as finished). the job can be freed
+ * inside of the callback.
+ * files are written into a temporary next to them, and renamed on
+ * success. on failure or cancel (M4ACUT_ERROR_CANCELLED), the temporary
+ * is removed, and an existing file is left untouched.
+ */
+typedef void (*m4acut_job_callback)(void *opaque, m4acut_job *job,
+                                    int status);
+
+int m4acut_session_write_file_async(m4acut_session *session,
+                                    const char *filename,
+                                    m4acut_job_callback callback,
+                                    void *opaque, m4acut_job **job);
+int m4acut_session_write_io_async(m4acut_session *session,
+                                  const m4acut_io *io,
+                                  m4acut_job_callback callback,
+                                  void *opaque, m4acut_job **job);
+/*
+ * eventfd (or read end of a pipe) readable when the job is finished.
+ * -1 when not available on the platform. owned by the job.
+ */
+int m4acut_job_get_fd(const m4acut_job *job);
+/* fraction of access units written so far, from 0.0 to 1.0 */
+double m4acut_job_get_progress(const m4acut_job *job);
+/* request cancel. returns immediately */
+void m4acut_job_cancel(m4acut_job *job);
+/* non-zero when finished */
+int m4acut_job_is_finished(m4acut_job *job);
+/* wait until finished, and return the status */
+int m4acut_job_wait(m4acut_job *job);
+/* message when the job has failed */
+const char *m4acut_job_get_error(m4acut_job *job);
+/* cancel and wait when not finished yet, then release */
+void m4acut_job_free(m4acut_job *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
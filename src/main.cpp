@@ -5,6 +5,8 @@
 #if HAVE_CONFIG_H
 # include "config.h"
 #endif
+#include <cctype>
+#include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -15,30 +17,66 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <exception>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <getopt.h>
 #include "M4ATrimmer.h"
+#include "WorkerPool.h"
 #include "compat.h"
 #include "cuesheet.h"
-#if HAVE_ICONV
-# include "StringConverterIConv.h"
-#elif defined(_WIN32)
-# include "StringConverterWin32.h"
-#else
-# include "StringConverterUTF8.h"
+#include "json.h"
+#include "BatchManifest.h"
+#include "InputCache.h"
+#include "LeaseDir.h"
+#include "MemoryBudget.h"
+#include "OutputJournal.h"
+#include "MP4Layout.h"
+#include "PlanManifest.h"
+#include "ResultCache.h"
+#ifndef _WIN32
+# include "UnixServer.h"
 #endif
+#include "StringConverter.h"
 #include "version.h"
 
 namespace {
 
 struct params_t {
-    const char *ifilename;
+    std::vector<const char *> ifilenames;
     const char *ofilename;
+    const char *outdir;
     const char *cuesheet;
     const char *cuesheet_encoding;
     TimeSpec start;
     TimeSpec end;
+    std::vector<TimeRange> ranges;
     bool chapter_mode;
+    bool join_mode;
+    bool plan_mode;
+    bool probe_mode;
+    bool normalize_mode;
     int  sbr_delay_fix;
+    unsigned jobs;
+    LayoutPolicy layout;
+    const char *manifest_file;
+    const char *journal_file;
+    unsigned journal_sync;  /* number of outputs synced at once */
+    const char *batch_file;
+    const char *serve_socket;
+    const char *lease_dir;
+    unsigned lease_timeout;  /* in seconds */
+    unsigned cache_size;  /* in MiB */
+    unsigned memory_limit;  /* in MiB */
+    const char *result_cache_dir;
+    unsigned result_cache_size;  /* in MiB */
+    std::shared_ptr<PlanManifest> manifest;
+    std::shared_ptr<OutputJournal> journal;
+    std::shared_ptr<InputCache> input_cache;
+    std::shared_ptr<MemoryBudget> memory_budget;
+    std::shared_ptr<ResultCache> result_cache;
 };
 
 std::string safe_filename(const std::string &s)
@@ -76,10 +114,28 @@ bool parse_timespec(const char *spec, TimeSpec *result)
     return true;
 }
 
+bool parse_range(const char *spec, TimeRange *result)
+{
+    const char *sep = std::strchr(spec, '-');
+    if (!sep)
+        return false;
+    std::string start(spec, sep - spec);
+    *result = TimeRange();
+    if (!parse_timespec(start.c_str(), &result->first))
+        return false;
+    return !sep[1] || parse_timespec(sep + 1, &result->second);
+}
+
 void usage()
 {
     std::printf(
 "Usage: m4acut [OPTIONS] INPUT_FILE\n"
+"       m4acut [OPTIONS] -C CUESHEET [INPUT_FILE...]\n"
+"       m4acut [OPTIONS] --normalize INPUT_FILE...\n"
+"       m4acut [OPTIONS] --join -o OUTPUT_FILE INPUT_FILE...\n"
+"       m4acut [OPTIONS] --batch MANIFEST\n"
+"       m4acut [OPTIONS] --serve SOCKET\n"
+"       m4acut [OPTIONS] --probe FILE_OR_DIR...\n"
 "Options:\n"
 " -h, --help             Print this help message\n"
 " -v, --version          Show version number\n"
@@ -96,12 +152,82 @@ void usage()
 " -e, --end <[[hh:]mm:]ss[.ss..]|ns>\n"
 "                        Specify cut end point (exclusive).\n"
 "                        When not given, end of input is assumed.\n"
+" -r, --range <start-[end]>\n"
+"                        Specify a range to keep (end is exclusive).\n"
+"                        Can be specified multiple times in ascending order.\n"
+"                        Given ranges are extracted into single output.\n"
+"                        Example:\n"
+"                          -r 0-1:00 -r 1:30-   : drop 1m to 1m30s\n"
 " -c, --chapter-mode     Split automatically at chapter points.\n"
 "                        Title tag and track tag are created from chapter.\n"
 " -C, --cuesheet <file>  Split automatically by cuesheet.\n"
+" --join                 Join inputs into single output without re-encoding.\n"
+"                        Inputs must share identical AudioSpecificConfig.\n"
+"                        Gapless trim of each input is kept, and chapters\n"
+"                        are written for each input.\n"
 " --cuesheet-encoding <name>\n"
 "                        Specify character encoding of cuesheet.\n"
 "                        By default, UTF-8 is assumed.\n"
+" --normalize            Remux whole of the input without cutting, placing\n"
+"                        moov first, with 1 sec. chunks and compact tables.\n"
+"                        Tags and chapters are carried over.\n"
+"                        Without -o, inputs are rewritten in place, and\n"
+"                        inputs already having optimal layout are skipped.\n"
+" --batch <file>         Run jobs in the manifest (JSON lines) in parallel.\n"
+"                        Each job is an object having \"input\" and either\n"
+"                        of \"output\" with \"start\"/\"end\" or \"ranges\",\n"
+"                        \"chapters\": true, or \"cuesheet\". Outputs of\n"
+"                        chapters/cuesheet go to \"outdir\" when given.\n"
+"                        Larger inputs are started first, and failed jobs\n"
+"                        don't stop others.\n"
+" --lease-dir <dir>      Share jobs of --batch with other workers (processes\n"
+"                        or hosts) through lease files in the directory.\n"
+"                        Result of each job is written into status file in\n"
+"                        the directory, and finished jobs are skipped.\n"
+" --lease-timeout <sec>  Lease not refreshed for this duration is taken\n"
+"                        over by another worker (default 300).\n"
+" --serve <socket>       Run as a server on the Unix domain socket.\n"
+"                        Each request is a line of JSON object in the same\n"
+"                        form as a job of --batch, and is responded by a\n"
+"                        line of {\"id\":...,\"ok\":true|false,\"error\":...}.\n"
+"                        Parsed inputs are cached for later requests.\n"
+" --cache-size <MiB>     Memory for cached inputs on --serve (default 256).\n"
+" --probe                Print properties of each input (codec, edits,\n"
+"                        iTunSMPB, chapters, tags and bitrates) in JSON\n"
+"                        lines to stdout, without reading media data.\n"
+"                        Directories are walked for .m4a/.m4b/.mp4 files.\n"
+"                        Inputs are probed in parallel (see -j).\n"
+" --plan                 Don't write anything, but print plan of each output\n"
+"                        (access unit range, edits, iTunSMPB, payload size,\n"
+"                        bitrates and estimated file size) in JSON lines to\n"
+"                        stdout.\n"
+" --manifest <file>      Record plan of each output into the manifest.\n"
+"                        Outputs whose plan is identical to the one in the\n"
+"                        manifest of previous run are not rewritten.\n"
+" --journal <file>       Record finished outputs into the journal, so that\n"
+"                        an interrupted run can be resumed, skipping them.\n"
+"                        Outputs are written into temporary files first.\n"
+" --journal-sync <n>     Number of outputs flushed to the storage at once\n"
+"                        before being recorded (default 64).\n"
+" --result-cache <dir>   Keep outputs in the directory, and serve the same\n"
+"                        output (same inputs, cut, tags and layout) again\n"
+"                        from it by hard link, reflink or copy.\n"
+" --result-cache-size <MiB>\n"
+"                        Max total size of --result-cache (default 1024).\n"
+"                        Least recently used outputs are evicted.\n"
+" --chunk-duration <sec>\n"
+"                        Max duration of chunks in output.\n"
+"                        By default, 0.5 sec. (1 sec. on --normalize).\n"
+" --chunk-size <bytes>   Max size of chunks in output.\n"
+" --compact-tables       Use compact sample size table (stz2) when sample\n"
+"                        sizes of the output allow. Always on --normalize.\n"
+" -j, --jobs <n>         Number of inputs processed in parallel, when\n"
+"                        cuesheet has multiple FILEs, or jobs in --batch.\n"
+"                        By default, number of CPUs is assumed (twice of\n"
+"                        it with --memory-limit).\n"
+" --memory-limit <MiB>   Start parallel jobs only while total of estimated\n"
+"                        peak memory usage of running jobs is under the\n"
+"                        limit. A job exceeding the limit runs alone.\n"
 " --fix-sbr-delay <1|-1>\n"
 "                        Modify media offset (delay) by the amount of\n"
 "                        SBR decoder delay (=481).\n"
@@ -118,15 +244,35 @@ bool parse_options(int argc, char **argv, params_t *params)
         { "output",            required_argument,  0, 'o' },
         { "start",             required_argument,  0, 's' },
         { "end",               required_argument,  0, 'e' },
+        { "range",             required_argument,  0, 'r' },
         { "chapter-mode",      no_argument,        0, 'c' },
         { "cuesheet",          required_argument,  0, 'C' },
+        { "join",              no_argument,        0, 'J' },
+        { "plan",              no_argument,        0, 'P' },
+        { "probe",             no_argument,        0, 'P' + 256 },
+        { "normalize",         no_argument,        0, 'N' },
+        { "manifest",          required_argument,  0, 'M' },
+        { "journal",           required_argument,  0, 'W' },
+        { "journal-sync",      required_argument,  0, 'W' + 256 },
+        { "result-cache",      required_argument,  0, 'R' },
+        { "result-cache-size", required_argument,  0, 'R' + 256 },
+        { "batch",             required_argument,  0, 'B' },
+        { "serve",             required_argument,  0, 'S' },
+        { "cache-size",        required_argument,  0, 'K' },
+        { "memory-limit",      required_argument,  0, 'X' },
+        { "lease-dir",         required_argument,  0, 'L' },
+        { "lease-timeout",     required_argument,  0, 'T' + 256 },
         { "cuesheet-encoding", required_argument,  0, 'E' },
         { "fix-sbr-delay",     required_argument,  0, 'F' },
+        { "jobs",              required_argument,  0, 'j' },
+        { "chunk-duration",    required_argument,  0, 'D' },
+        { "chunk-size",        required_argument,  0, 'Z' },
+        { "compact-tables",    no_argument,        0, 'T' },
         {  0,                  0,                  0,  0  },
     };
 
     int ch;
-    while ((ch = getopt_long(argc, argv, "hvo:s:e:cC:",
+    while ((ch = getopt_long(argc, argv, "hvo:s:e:r:cC:j:",
                              long_options, 0)) != EOF)
     {
         switch (ch) {
@@ -150,12 +296,90 @@ bool parse_options(int argc, char **argv, params_t *params)
                 return false;
             }
             break;
+        case 'r':
+            {
+                TimeRange range;
+                if (!parse_range(optarg, &range)) {
+                    std::fputs("ERROR: malformed range for -r\n", stderr);
+                    return false;
+                }
+                params->ranges.push_back(range);
+            }
+            break;
         case 'c':
             params->chapter_mode = true;
             break;
         case 'C':
             params->cuesheet = optarg;
             break;
+        case 'J':
+            params->join_mode = true;
+            break;
+        case 'P':
+            params->plan_mode = true;
+            break;
+        case 'P' + 256:
+            params->probe_mode = true;
+            break;
+        case 'N':
+            params->normalize_mode = true;
+            break;
+        case 'M':
+            params->manifest_file = optarg;
+            break;
+        case 'W':
+            params->journal_file = optarg;
+            break;
+        case 'W' + 256:
+            if (std::sscanf(optarg, "%u", &params->journal_sync) != 1
+                || !params->journal_sync) {
+                std::fputs("ERROR: invalid arg for --journal-sync\n",
+                           stderr);
+                return false;
+            }
+            break;
+        case 'R':
+            params->result_cache_dir = optarg;
+            break;
+        case 'R' + 256:
+            if (std::sscanf(optarg, "%u", &params->result_cache_size) != 1
+                || !params->result_cache_size) {
+                std::fputs("ERROR: invalid arg for --result-cache-size\n",
+                           stderr);
+                return false;
+            }
+            break;
+        case 'B':
+            params->batch_file = optarg;
+            break;
+        case 'S':
+            params->serve_socket = optarg;
+            break;
+        case 'L':
+            params->lease_dir = optarg;
+            break;
+        case 'T' + 256:
+            if (std::sscanf(optarg, "%u", &params->lease_timeout) != 1
+                || !params->lease_timeout) {
+                std::fputs("ERROR: invalid arg for --lease-timeout\n",
+                           stderr);
+                return false;
+            }
+            break;
+        case 'K':
+            if (std::sscanf(optarg, "%u", &params->cache_size) != 1) {
+                std::fputs("ERROR: invalid arg for --cache-size\n", stderr);
+                return false;
+            }
+            break;
+        case 'X':
+            if (std::sscanf(optarg, "%u", &params->memory_limit) != 1
+                || !params->memory_limit) {
+                std::fputs("ERROR: invalid arg for --memory-limit\n",
+                           stderr);
+                return false;
+            }
+            break;
         case 'E':
             params->cuesheet_encoding = optarg;
             break;
@@ -165,6 +389,35 @@ bool parse_options(int argc, char **argv, params_t *params)
                 return false;
             }
             break;
+        case 'j':
+            if (std::sscanf(optarg, "%u", &params->jobs) != 1
+                || !params->jobs) {
+                std::fputs("ERROR: invalid arg for -j\n", stderr);
+                return false;
+            }
+            break;
+        case 'D':
+            if (std::sscanf(optarg, "%lf", &params->layout.chunk_duration) != 1
+                || params->layout.chunk_duration <= 0.0) {
+                std::fputs("ERROR: invalid arg for --chunk-duration\n",
+                           stderr);
+                return false;
+            }
+            break;
+        case 'Z':
+            {
+                unsigned long long n;
+                if (std::sscanf(optarg, "%llu", &n) != 1 || !n) {
+                    std::fputs("ERROR: invalid arg for --chunk-size\n",
+                               stderr);
+                    return false;
+                }
+                params->layout.chunk_size = n;
+            }
+            break;
+        case 'T':
+            params->layout.compact_tables = true;
+            break;
         default:
             return false;
         }
@@ -172,162 +425,985 @@ bool parse_options(int argc, char **argv, params_t *params)
     argc -= optind;
     argv += optind;
 
-    if (argc != 1)
+    if (params->journal_file && (params->serve_socket || params->plan_mode)) {
+        std::fputs("ERROR: --journal can't be used with --serve/--plan\n",
+                   stderr);
+        return false;
+    }
+    if (params->lease_dir && !params->batch_file) {
+        std::fputs("ERROR: --lease-dir requires --batch\n", stderr);
+        return false;
+    }
+    if (params->batch_file || params->serve_socket) {
+        if (argc > 0 || params->ofilename || params->chapter_mode
+            || params->cuesheet || params->join_mode
+            || params->normalize_mode || params->ranges.size()
+            || params->start.value.samples || params->end.value.samples
+            || (params->batch_file && params->serve_socket)) {
+            std::fputs("ERROR: --batch/--serve can't be used with inputs or "
+                       "operation options\n", stderr);
+            return false;
+        }
+        return true;
+    }
+    if (params->probe_mode) {
+        if (params->ofilename || params->chapter_mode || params->cuesheet
+            || params->join_mode || params->normalize_mode
+            || params->plan_mode || params->ranges.size()
+            || params->start.value.samples || params->end.value.samples) {
+            std::fputs("ERROR: --probe can't be used with output or "
+                       "operation options\n", stderr);
+            return false;
+        }
+        if (argc < 1)
+            return usage(), false;
+        params->ifilenames.assign(argv, argv + argc);
+        return true;
+    }
+    if ((argc < 1 && !params->cuesheet)
+        || (argc > 1 && !params->join_mode && !params->cuesheet
+            && !params->normalize_mode))
         return usage(), false;
 
-    params->ifilename = argv[0];
+    params->ifilenames.assign(argv, argv + argc);
     int ne = params->chapter_mode
+           + params->join_mode
+           + params->normalize_mode
            + (params->start.value.samples || params->end.value.samples)
+           + (params->ranges.size() > 0)
            + (params->cuesheet != nullptr);
     if (ne > 1) {
-        std::fputs("ERROR: -c , -C, and -s/-e are mutually exclusive\n",
-                   stderr);
+        std::fputs("ERROR: -c , -C, -r, -s/-e, --join and --normalize are "
+                   "mutually exclusive\n", stderr);
         return false;
     }
-    if (!params->chapter_mode && !params->cuesheet && !params->ofilename) {
+    if (params->normalize_mode && params->ofilename && argc > 1) {
+        std::fputs("ERROR: -o can't be used with multiple inputs\n", stderr);
+        return false;
+    }
+    if (!params->chapter_mode && !params->cuesheet && !params->ofilename
+        && !params->normalize_mode) {
         std::fputs("ERROR: output filename is required\n", stderr);
         return false;
     }
     return true;
 }
 
-void process_file(M4ATrimmer &trimmer)
+void process_file(M4ATrimmer &trimmer, bool show_progress=true)
 {
     uint64_t au, num_au = trimmer.num_access_units();
 
     int64_t last = 0;
     for (au = 1; trimmer.copy_next_access_unit(); ++au) {
         int64_t now = aa_timer();
-        if (now - last > 1000) {
+        if (show_progress && now - last > 1000) {
             int percent = static_cast<int>(au * 100 / num_au);
             std::fprintf(stderr, "\r%d%%", percent);
             last = now;
         }
     }
     trimmer.finish_write(0, 0);
-    std::fputs("\r100%...done\n", stderr);
-}
-
-void set_tag(M4ATrimmer &trimmer, const std::string &k, const std::string &v)
-{
-    struct tag_item {
-        const char                 *name;
-        lsmash_itunes_metadata_item fcc;
-    } tag_items[] = {
-        { "ALBUM",          ITUNES_METADATA_ITEM_ALBUM_NAME   },
-        { "ALBUMARTIST",    ITUNES_METADATA_ITEM_ALBUM_ARTIST },
-        { "ARTIST",         ITUNES_METADATA_ITEM_ARTIST       },
-        { "DATE",           ITUNES_METADATA_ITEM_RELEASE_DATE },
-        { "DISC",           ITUNES_METADATA_ITEM_DISC_NUMBER  },
-        { "GENRE",          ITUNES_METADATA_ITEM_USER_GENRE   },
-        { "SONGWRITER",     ITUNES_METADATA_ITEM_COMPOSER     },
-        { "TITLE",          ITUNES_METADATA_ITEM_TITLE        },
-        { "TRACK",          ITUNES_METADATA_ITEM_TRACK_NUMBER },
-        { 0,                ITUNES_METADATA_ITEM_CUSTOM       }
-    };
+    if (show_progress)
+        std::fputs("\r100%...done\n", stderr);
+}
 
-    lsmash_itunes_metadata_item fcc = ITUNES_METADATA_ITEM_CUSTOM;
-    for (tag_item *p = tag_items; p->name; ++p) {
-        if (k == p->name) {
-            fcc = p->fcc;
-            break;
-        }
+/*
+ * plan for the output as a JSON object.
+ */
+std::string plan_json(const M4ATrimmer &trimmer, const std::string &name)
+{
+    std::stringstream ss;
+    ss << "{\"input\":" << json_quote(trimmer.input_filename(0))
+       << ",\"output\":" << json_quote(name)
+       << ",\"inputs\":[";
+    auto &ranges = trimmer.cut_ranges();
+    std::vector<size_t> inputs;
+    for (auto r = ranges.begin(); r != ranges.end(); ++r)
+        if (std::find(inputs.begin(), inputs.end(), r->input) == inputs.end())
+            inputs.push_back(r->input);
+    for (auto i = inputs.begin(); i != inputs.end(); ++i) {
+        const std::string &filename = trimmer.input_filename(*i);
+        aa_stat_t st = {};
+        aa_stat(filename.c_str(), &st);
+        ss << (i == inputs.begin() ? "" : ",")
+           << "{\"filename\":" << json_quote(filename)
+           << ",\"size\":" << json_number(st.size)
+           << ",\"mtime\":" << json_number(st.mtime)
+           << ",\"ino\":" << json_number(st.ino) << "}";
+    }
+    ss << "],\"timescale\":" << trimmer.timescale()
+       << ",\"cut_start\":" << json_number(trimmer.cut_start())
+       << ",\"cut_end\":" << json_number(trimmer.cut_end())
+       << ",\"ranges\":[";
+    for (auto r = ranges.begin(); r != ranges.end(); ++r) {
+        ss << (r == ranges.begin() ? "" : ",")
+           << "{\"input\":" << json_quote(trimmer.input_filename(r->input))
+           << ",\"begin\":" << json_number(r->begin)
+           << ",\"end\":" << json_number(r->end) << "}";
+    }
+    ss << "],\"edits\":[";
+    const MP4Edits &edits = trimmer.output_edits();
+    for (unsigned i = 0; i < edits.count(); ++i)
+        ss << (i ? "," : "") << "{\"media_time\":"
+           << json_number(edits.offset(i))
+           << ",\"duration\":" << json_number(edits.duration(i)) << "}";
+    ss << "],\"iTunSMPB\":";
+    uint32_t priming, padding;
+    uint64_t duration;
+    if (trimmer.get_iTunSMPB(&priming, &padding, &duration))
+        ss << "{\"priming\":" << priming << ",\"padding\":" << padding
+           << ",\"duration\":" << json_number(duration) << "}";
+    else
+        ss << "null";
+    PayloadStats stats = trimmer.payload_stats();
+    ss << ",\"payload_size\":" << json_number(stats.size)
+       << ",\"avg_bitrate\":" << stats.avg_bitrate
+       << ",\"max_bitrate\":" << stats.max_bitrate
+       << ",\"estimated_size\":"
+       << json_number(trimmer.estimate_file_size(stats.size))
+       << ",\"tags\":{";
+    std::map<std::string, std::string> tags;
+    trimmer.get_tags(&tags);
+    for (auto t = tags.begin(); t != tags.end(); ++t)
+        ss << (t == tags.begin() ? "" : ",") << json_quote(t->first) << ":"
+           << json_quote(t->second);
+    ss << "}}";
+    return ss.str();
+}
+
+/* JSON members for the layout policy of the output */
+std::string layout_json(const LayoutPolicy &policy)
+{
+    std::stringstream ss;
+    ss << "\"chunk_duration\":" << json_number(policy.chunk_duration)
+       << ",\"chunk_size\":" << json_number(policy.chunk_size)
+       << ",\"compact_tables\":" << (policy.compact_tables ? "true" : "false");
+    return ss.str();
+}
+
+/*
+ * key of the output in --result-cache.
+ * everything determining content of the output but the output filename.
+ */
+std::string result_key(const M4ATrimmer &trimmer)
+{
+    std::stringstream ss;
+    ss << "{\"version\":" << json_quote(m4acut_version)
+       << "," << layout_json(trimmer.layout_policy())
+       << ",\"plan\":" << plan_json(trimmer, std::string()) << "}";
+    return ss.str();
+}
+
+/*
+ * entry of the output in --manifest: the plan, and the layout policy
+ * which also changes the output.
+ */
+std::string manifest_entry(const M4ATrimmer &trimmer, const std::string &name)
+{
+    std::stringstream ss;
+    ss << "{\"output\":" << json_quote(name)
+       << "," << layout_json(trimmer.layout_policy())
+       << ",\"plan\":" << plan_json(trimmer, name) << "}";
+    return ss.str();
+}
+
+/*
+ * properties of the input as a JSON object, for --probe.
+ * whole of the input has to be selected for the bitrates.
+ */
+std::string probe_json(const M4ATrimmer &trimmer)
+{
+    const std::string &filename = trimmer.input_filename(0);
+    aa_stat_t st = {};
+    aa_stat(filename.c_str(), &st);
+    std::stringstream ss;
+    ss << "{\"input\":" << json_quote(filename)
+       << ",\"size\":" << json_number(st.size)
+       << ",\"mtime\":" << json_number(st.mtime)
+       << ",\"aot\":" << static_cast<unsigned>(trimmer.aot())
+       << ",\"sample_rate\":" << trimmer.sample_rate()
+       << ",\"frames_per_packet\":" << trimmer.frames_per_packet()
+       << ",\"timescale\":" << trimmer.timescale()
+       << ",\"duration\":" << json_number(trimmer.duration())
+       << ",\"edits\":[";
+    const MP4Edits &edits = trimmer.input_edits();
+    for (unsigned i = 0; i < edits.count(); ++i)
+        ss << (i ? "," : "") << "{\"media_time\":"
+           << json_number(edits.offset(i))
+           << ",\"duration\":" << json_number(edits.duration(i)) << "}";
+    ss << "],\"iTunSMPB\":";
+    uint32_t priming, padding;
+    uint64_t duration;
+    if (trimmer.get_input_iTunSMPB(&priming, &padding, &duration))
+        ss << "{\"priming\":" << priming << ",\"padding\":" << padding
+           << ",\"duration\":" << json_number(duration) << "}";
+    else
+        ss << "null";
+    ss << ",\"chapters\":[";
+    auto &chapters = trimmer.chapters();
+    for (auto c = chapters.begin(); c != chapters.end(); ++c)
+        ss << (c == chapters.begin() ? "" : ",")
+           << "{\"start\":" << json_number(c->first)
+           << ",\"title\":" << json_quote(c->second) << "}";
+    PayloadStats stats = trimmer.payload_stats();
+    ss << "],\"payload_size\":" << json_number(stats.size)
+       << ",\"avg_bitrate\":" << stats.avg_bitrate
+       << ",\"max_bitrate\":" << stats.max_bitrate
+       << ",\"tags\":{";
+    std::map<std::string, std::string> tags;
+    trimmer.get_tags(&tags);
+    for (auto t = tags.begin(); t != tags.end(); ++t)
+        ss << (t == tags.begin() ? "" : ",") << json_quote(t->first) << ":"
+           << json_quote(t->second);
+    ss << "}}";
+    return ss.str();
+}
+
+/* output filename for automatically named outputs (chapters, cuesheet) */
+std::string output_path(const params_t &params, const std::string &name)
+{
+    if (!params.outdir || !*params.outdir)
+        return name;
+    std::string dir = params.outdir;
+    if (!std::strchr("/\\", dir[dir.size() - 1]))
+        dir.push_back('/');
+    return dir + name;
+}
+
+/*
+ * write the selected range of trimmer into the output,
+ * or print the plan of it when in plan mode.
+ */
+void write_output(M4ATrimmer &trimmer, const std::string &name,
+                  const params_t &params, bool show_progress=true)
+{
+    static std::mutex mutex;
+    if (params.plan_mode) {
+        std::string plan = plan_json(trimmer, name);
+        std::lock_guard<std::mutex> lock(mutex);
+        aa_fprintf(stdout, "%s\n", plan.c_str());
+        return;
     }
-    switch (fcc) {
-    case ITUNES_METADATA_ITEM_ALBUM_NAME:
-    case ITUNES_METADATA_ITEM_ALBUM_ARTIST:
-    case ITUNES_METADATA_ITEM_ARTIST:
-    case ITUNES_METADATA_ITEM_RELEASE_DATE:
-    case ITUNES_METADATA_ITEM_USER_GENRE:
-    case ITUNES_METADATA_ITEM_COMPOSER:
-    case ITUNES_METADATA_ITEM_TITLE:
-        trimmer.set_text_tag(fcc, v);
-        break;
-    case ITUNES_METADATA_ITEM_DISC_NUMBER:
-        {
-            unsigned n, t = 0;
-            if (std::sscanf(v.c_str(), "%u/%u", &n, &t) > 0)
-                trimmer.set_disk_tag(n, t);
+    std::string plan;
+    if (params.manifest) {
+        plan = manifest_entry(trimmer, name);
+        if (params.manifest->is_unchanged(name, plan)) {
+            aa_fprintf(stderr, "%s: unchanged, skipped\n", name.c_str());
+            params.manifest->update(name, plan);
+            return;
         }
-        break;
-    case ITUNES_METADATA_ITEM_TRACK_NUMBER:
-        {
-            unsigned n, t = 0;
-            if (std::sscanf(v.c_str(), "%u/%u", &n, &t) > 0)
-                trimmer.set_track_tag(n, t);
+    }
+    if (params.journal && params.journal->is_done(name)) {
+        aa_fprintf(stderr, "%s: done in previous run, skipped\n",
+                   name.c_str());
+        if (params.manifest)
+            params.manifest->update(name, plan);
+        return;
+    }
+    std::string key;
+    if (params.result_cache)
+        key = result_key(trimmer);
+    if (!params.journal && !params.result_cache) {
+        aa_fprintf(stderr, "%s\n", name.c_str());
+        trimmer.open_output(name);
+        process_file(trimmer, show_progress);
+        if (params.manifest)
+            params.manifest->update(name, plan);
+        return;
+    }
+    /*
+     * output is written into a temporary and renamed, since it can be
+     * a hard link to the entry of the result cache.
+     */
+    std::string path = params.journal ? params.journal->begin(name)
+                                      : name + ".m4acut-tmp";
+    try {
+        if (params.result_cache && params.result_cache->fetch(key, path))
+            aa_fprintf(stderr, "%s: from result cache\n", name.c_str());
+        else {
+            aa_fprintf(stderr, "%s\n", name.c_str());
+            trimmer.open_output(path);
+            process_file(trimmer, show_progress);
+            trimmer.close_output();
+            if (params.result_cache)
+                params.result_cache->store(key, path);
         }
-        break;
-    default: break;
+    } catch (...) {
+        trimmer.close_output();
+        if (params.journal)
+            params.journal->abort(name);
+        else
+            aa_unlink(path.c_str());
+        throw;
+    }
+    if (params.journal)
+        params.journal->commit(name);
+    else if (aa_rename(path.c_str(), name.c_str())) {
+        int err = errno;
+        aa_unlink(path.c_str());
+        throw_file_error(name, std::strerror(err));
     }
+    if (params.manifest)
+        params.manifest->update(name, plan);
 }
 
-void process_cuesheet(M4ATrimmer &trimmer, const params_t &params)
+/*
+ * run job(i) for each of names on WorkerPool.
+ * failure of a job is reported with the name, and doesn't stop others.
+ * returns number of failed jobs.
+ */
+unsigned run_in_parallel(const params_t &params,
+                         const std::vector<std::string> &names,
+                         const std::function<void(size_t)> &job)
+{
+    unsigned nworkers = params.jobs ? params.jobs
+                                    : WorkerPool::default_concurrency();
+    /*
+     * with --memory-limit, jobs wait for admission before opening inputs,
+     * so more workers than CPUs are started for small inputs.
+     */
+    if (!params.jobs && params.memory_budget)
+        nworkers *= 2;
+    std::mutex mutex;
+    unsigned nerrors = 0;
+    WorkerPool pool(std::min<size_t>(nworkers, names.size()));
+    for (size_t i = 0; i < names.size(); ++i) {
+        pool.submit([&, i]() {
+            try {
+                job(i);
+            } catch (const std::exception &e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                aa_fprintf(stderr, "%s: %s\n", names[i].c_str(), e.what());
+                ++nerrors;
+            }
+        });
+    }
+    pool.wait();
+    return nerrors;
+}
+
+void load_cuesheet(const params_t &params, CueSheet *cuesheet)
 {
     FILE *fp = aa_fopen(params.cuesheet, "r");
     if (!fp)
         throw_file_error(params.cuesheet, std::strerror(errno));
     std::shared_ptr<FILE> __fp__(fp, std::fclose);
 
-    std::string data;
-    char buf[8192];
-    size_t n;
-    while ((n = std::fread(buf, 1, sizeof buf, fp)) > 0)
-        data.append(buf, n);
-    if (data.size() >= 3 && data.substr(0,3) == "\xef\xbb\xbf")
-        data = data.substr(3);
+    /* read at once, sized by the file */
+    aa_stat_t st;
+    std::string data(aa_stat(params.cuesheet, &st) == 0 ? st.size + 1 : 8192,
+                     '\0');
+    size_t n, len = 0;
+    while ((n = std::fread(&data[len], 1, data.size() - len, fp)) > 0)
+        if ((len += n) == data.size())
+            data.resize(len * 2);
+    data.resize(len);
+    size_t bom = 0;
+    if (data.compare(0, 3, "\xef\xbb\xbf") == 0) {
+        data.erase(0, 3);
+        bom = 3;
+    }
 
-    std::shared_ptr<IStringConverter> converter;
     const char *encoding = params.cuesheet_encoding;
     if (!encoding) encoding = "UTF-8";
-#if HAVE_ICONV
-    converter = std::make_shared<StringConverterIConv>("UTF-8", encoding);
-#elif defined(_WIN32)
-    converter = std::make_shared<StringConverterWin32>("UTF-8", encoding);
-#else
-    converter = std::make_shared<StringConverterUTF8>();
-#endif
-    auto res = converter->convert(data, true);
-    if (!res.first) {
+    size_t error_offset;
+    if (!convert_to_utf8(encoding, &data, &error_offset)) {
         std::stringstream msg;
-        msg << "cuesheet isn't encoded with " << encoding 
-            << ", specify correct character encoding by --cuesheet-encoding";
+        msg << "cuesheet isn't encoded with " << encoding;
+        if (error_offset != std::string::npos) {
+            size_t line = 1 + std::count(data.begin(),
+                                         data.begin() + error_offset, '\n');
+            msg << " (invalid byte at line " << line << ", offset "
+                << bom + error_offset << ")";
+        }
+        msg << ", specify correct character encoding by --cuesheet-encoding";
         throw std::runtime_error(msg.str());
     }
-    std::stringstream ss(res.second);
-    CueSheet cuesheet;
-    cuesheet.parse(ss.rdbuf());
+    /* the tokenizer splits the converted text in place */
+    cuesheet->parse(&data[0], data.size());
+}
+
+bool file_exists(const std::string &filename)
+{
+    FILE *fp = aa_fopen(filename.c_str(), "rb");
+    if (fp) std::fclose(fp);
+    return fp != 0;
+}
+
+/*
+ * FILE in cuesheet is relative to the cuesheet.
+ * FILE often refers to the original WAV from which M4A was encoded,
+ * so M4A of the same basename is also looked for.
+ */
+std::string resolve_cue_file(const std::string &cuesheet,
+                             const std::string &filename)
+{
+    std::string path = filename;
+    size_t pos = cuesheet.find_last_of("/\\");
+    if (pos != std::string::npos && !strchr("/\\", filename[0])
+        && filename.find(':') == std::string::npos)
+        path = cuesheet.substr(0, pos + 1) + filename;
+    if (file_exists(path))
+        return path;
+    std::string m4a = path.substr(0, path.find_last_of('.')) + ".m4a";
+    if (file_exists(m4a))
+        return m4a;
+    throw_file_error(path, "cannot find FILE in cuesheet");
+    return path;
+}
+
+/* estimated memory usage of a job under --memory-limit */
+uint64_t memory_estimate(const params_t &params,
+                         const std::vector<std::string> &inputs)
+{
+    return params.memory_budget ? MemoryBudget::estimate(inputs) : 0;
+}
+
+/* open input through the cache when available (--serve) */
+void open_input(M4ATrimmer &trimmer, const params_t &params,
+                const std::string &filename)
+{
+    if (params.input_cache)
+        params.input_cache->open_input(&trimmer, filename);
+    else
+        trimmer.open_input(filename);
+}
+
+/*
+ * split tracks starting in the cuesheet FILE into outputs.
+ * track numbers and tags are global in the cuesheet.
+ */
+void process_cue_file(const params_t &params, const CueSheet &cuesheet,
+                      const std::string &cue_file, const std::string &input,
+                      bool show_progress)
+{
+    MemoryGrant grant(params.memory_budget.get(),
+                      memory_estimate(params,
+                                      std::vector<std::string>(1, input)));
+    M4ATrimmer trimmer;
+    trimmer.set_layout_policy(params.layout);
+    open_input(trimmer, params, input);
+    if (params.sbr_delay_fix)
+        trimmer.shift_edits(params.sbr_delay_fix * 481);
+
     std::vector<std::pair<double, std::string>> chapters;
-    cuesheet.as_chapters(static_cast<double>(trimmer.duration())/
+    cuesheet.as_chapters(cue_file, static_cast<double>(trimmer.duration())/
                          trimmer.timescale(), &chapters);
     size_t i = 0;
     double dts = 0.0;
     for (auto track = cuesheet.begin(); track != cuesheet.end(); ++track) {
+        if (track->filename() != cue_file)
+            continue;
         double duration = chapters[i++].first;
         std::map<std::string, std::string> tags;
         track->get_tags(&tags);
+        trimmer.reset_tags();
         for (auto t = tags.begin(); t != tags.end(); ++t)
-            set_tag(trimmer, t->first, t->second);
+            trimmer.set_tag(t->first, t->second);
         std::stringstream name;
         name << std::setfill('0') << std::setw(2) << track->number();
         if (!track->name().empty())
             name << ' ' << safe_filename(track->name()) << ".m4a";
-        aa_fprintf(stderr, "%s\n", name.str().c_str());
-        trimmer.open_output(name.str());
         TimeSpec beg, end;
         beg.is_samples    = end.is_samples = false;
         beg.value.seconds = dts;
         end.value.seconds = dts + duration;
         dts += duration;
         trimmer.select_cut_point(beg, end);
-        process_file(trimmer);
+        write_output(trimmer, output_path(params, name.str()), params,
+                     show_progress);
+    }
+}
+
+void process_cuesheet(const params_t &params, bool show_progress)
+{
+    CueSheet cuesheet;
+    load_cuesheet(params, &cuesheet);
+
+    const std::vector<std::string> &files = cuesheet.files();
+    std::vector<std::string> inputs(params.ifilenames.begin(),
+                                    params.ifilenames.end());
+    if (inputs.empty()) {
+        for (auto f = files.begin(); f != files.end(); ++f)
+            inputs.push_back(resolve_cue_file(params.cuesheet, *f));
+    } else if (inputs.size() != files.size())
+        throw std::runtime_error("number of input files doesn't match "
+                                 "number of FILEs in cuesheet");
+
+    if (files.size() == 1) {
+        process_cue_file(params, cuesheet, files[0], inputs[0],
+                         show_progress);
+        return;
+    }
+    unsigned nerrors = run_in_parallel(params, inputs, [&](size_t i) {
+        process_cue_file(params, cuesheet, files[i], inputs[i], false);
+    });
+    if (nerrors)
+        throw std::runtime_error("failed to process some of FILEs "
+                                 "in cuesheet");
+}
+
+/*
+ * M4ATrimmer carries over only the first sound track, and the first text
+ * track (as chapters)
+ */
+bool carries_all_tracks(const MP4Layout &layout)
+{
+    unsigned sound = 0, text = 0;
+    for (auto h = layout.handlers.begin(); h != layout.handlers.end(); ++h) {
+        if (*h == "soun")
+            ++sound;
+        else if (*h == "text")
+            ++text;
+        else
+            return false;
+    }
+    return sound <= 1 && text <= 1;
+}
+
+/*
+ * remux whole of the input.
+ * without -o, the input is replaced with the result unless the input
+ * already has optimal layout.
+ */
+void normalize_file(const params_t &params, const std::string &input,
+                    bool show_progress)
+{
+    LayoutPolicy policy = params.layout;
+    if (policy.chunk_duration <= 0.0)
+        policy.chunk_duration = 1.0;
+    policy.compact_tables = true;
+    bool in_place = !params.ofilename && !params.plan_mode;
+    std::string output = params.ofilename ? params.ofilename
+                                          : input + ".m4acut-tmp";
+    /* inspected once, for both of the check and the memory estimate */
+    MP4Layout layout;
+    if (in_place || params.memory_budget)
+        layout.inspect(input, in_place);
+    /*
+     * skip only when nothing but the layout is requested: the check sees
+     * neither a shift of edits nor chunks cut by size
+     */
+    if (in_place && !params.sbr_delay_fix && !policy.chunk_size) {
+#if HAVE_COMPACT_SAMPLE_SIZE_TABLE
+        bool compact_tables = policy.compact_tables;
+#else
+        bool compact_tables = false;  /* stz2 cannot be written */
+#endif
+        if (layout.is_optimal(policy.chunk_duration, compact_tables)) {
+            aa_fprintf(stderr, "%s: already optimal, skipped\n",
+                       input.c_str());
+            return;
+        }
+    }
+    if (in_place && !carries_all_tracks(layout))
+        throw_file_error(input, "has tracks other than audio and chapters, "
+                                "which would be lost (use -o)");
+    try {
+        MemoryGrant grant(params.memory_budget.get(),
+                          params.memory_budget ? MemoryBudget::estimate(layout)
+                                               : 0);
+        M4ATrimmer trimmer;
+        trimmer.set_layout_policy(policy);
+        trimmer.open_input(input);
+        if (params.sbr_delay_fix)
+            trimmer.shift_edits(params.sbr_delay_fix * 481);
+        trimmer.select_all();
+        write_output(trimmer, output, params, show_progress);
+    } catch (...) {
+        if (in_place)
+            aa_unlink(output.c_str());
+        throw;
+    }
+    /* input has to be closed before being replaced */
+    if (in_place && aa_rename(output.c_str(), input.c_str())) {
+        int err = errno;
+        aa_unlink(output.c_str());
+        throw_file_error(input, std::strerror(err));
+    }
+}
+
+void normalize(const params_t &params)
+{
+    std::vector<std::string> inputs(params.ifilenames.begin(),
+                                    params.ifilenames.end());
+    if (inputs.size() == 1) {
+        normalize_file(params, inputs[0], true);
+        return;
+    }
+    unsigned nerrors = run_in_parallel(params, inputs, [&](size_t i) {
+        normalize_file(params, inputs[i], false);
+    });
+    if (nerrors)
+        throw std::runtime_error("failed to normalize some of inputs");
+}
+
+/* files looked into when walking directories on --probe */
+bool is_m4a_filename(const std::string &name)
+{
+    size_t pos = name.find_last_of('.');
+    if (pos == std::string::npos)
+        return false;
+    std::string ext = name.substr(pos + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) {
+        return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+    return ext == "m4a" || ext == "m4b" || ext == "mp4";
+}
+
+int collect_dir_entry(void *opaque, const char *name)
+{
+    static_cast<std::vector<std::string> *>(opaque)->push_back(name);
+    return 0;
+}
+
+/*
+ * print properties of each input, walking directories.
+ * directories are walked by the workers as well, so that walking and
+ * probing overlap. results are printed in the order of completion.
+ */
+void probe(const params_t &params)
+{
+    unsigned nworkers = params.jobs ? params.jobs
+                                    : WorkerPool::default_concurrency();
+    WorkerPool pool(nworkers);
+    std::mutex mutex;
+    unsigned nfiles = 0, nerrors = 0;
+
+    auto probe_file = [&](const std::string &filename) {
+        std::string result;
+        bool ok = true;
+        try {
+            M4ATrimmer trimmer;
+            trimmer.open_input(filename);
+            trimmer.select_all();
+            result = probe_json(trimmer);
+        } catch (const std::exception &e) {
+            result = "{\"input\":" + json_quote(filename)
+                   + ",\"error\":" + json_quote(e.what()) + "}";
+            ok = false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        aa_fprintf(stdout, "%s\n", result.c_str());
+        ++nfiles;
+        if (!ok) ++nerrors;
+    };
+    /* depth is limited against loops by symbolic links */
+    std::function<void(const std::string &, unsigned)> walk =
+        [&](const std::string &dir, unsigned depth) {
+            std::vector<std::string> names;
+            if (depth > 64 || aa_readdir(dir.c_str(), collect_dir_entry,
+                                         &names) < 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                aa_fprintf(stderr, "%s: %s\n", dir.c_str(),
+                           depth > 64 ? "too deep" : std::strerror(errno));
+                ++nerrors;
+                return;
+            }
+            std::sort(names.begin(), names.end());
+            for (auto n = names.begin(); n != names.end(); ++n) {
+                std::string path = dir;
+                if (!std::strchr("/\\", path[path.size() - 1]))
+                    path.push_back('/');
+                path += *n;
+                aa_stat_t st;
+                if (aa_stat(path.c_str(), &st) < 0)
+                    continue;
+                if (st.is_dir)
+                    pool.submit([&, path, depth]() { walk(path, depth + 1); });
+                else if (is_m4a_filename(*n))
+                    pool.submit([&, path]() { probe_file(path); });
+            }
+        };
+    for (auto i = params.ifilenames.begin(); i != params.ifilenames.end();
+         ++i) {
+        std::string name = *i;
+        aa_stat_t st;
+        if (aa_stat(name.c_str(), &st) == 0 && st.is_dir)
+            pool.submit([&, name]() { walk(name, 0); });
+        else
+            pool.submit([&, name]() { probe_file(name); });
+    }
+    pool.wait();
+    if (nerrors) {
+        std::stringstream ss;
+        ss << nerrors << " of " << nfiles << " inputs failed to probe";
+        throw std::runtime_error(ss.str());
     }
 }
 
+void run(const params_t &params, bool show_progress=true)
+{
+    if (params.normalize_mode) {
+        normalize(params);
+        return;
+    }
+    if (params.cuesheet) {
+        process_cuesheet(params, show_progress);
+        return;
+    }
+    std::vector<std::string> inputs(params.ifilenames.begin(),
+                                    params.ifilenames.end());
+    MemoryGrant grant(params.memory_budget.get(),
+                      memory_estimate(params, inputs));
+    M4ATrimmer trimmer;
+    trimmer.set_layout_policy(params.layout);
+    open_input(trimmer, params, params.ifilenames[0]);
+    for (size_t i = 1; i < params.ifilenames.size(); ++i)
+        trimmer.append_input(params.ifilenames[i]);
+    if (params.sbr_delay_fix)
+        trimmer.shift_edits(params.sbr_delay_fix * 481);
+    if (params.chapter_mode) {
+        auto chapters = trimmer.chapters();
+        if (!chapters.size())
+            throw std::runtime_error("no chapters in the file");
+        for (size_t i = 0; i < chapters.size(); ++i) {
+            std::stringstream ss;
+            ss << std::setfill('0') << std::setw(2) << (i + 1)
+               << ' ' << safe_filename(chapters[i].second) << ".m4a";
+            trimmer.select_chapter(i);
+            write_output(trimmer, output_path(params, ss.str()), params,
+                         show_progress);
+        }
+    } else if (params.join_mode) {
+        trimmer.select_joined_inputs();
+        write_output(trimmer, params.ofilename, params, show_progress);
+    } else if (params.ranges.size()) {
+        trimmer.select_cut_ranges(params.ranges);
+        write_output(trimmer, params.ofilename, params, show_progress);
+    } else {
+        trimmer.select_cut_point(params.start, params.end);
+        write_output(trimmer, params.ofilename, params, show_progress);
+    }
+}
+
+/*
+ * set up parameters of the batch job, inheriting global options.
+ * strings in params refer to the job.
+ */
+void batch_job_params(const BatchJob &job, params_t *params)
+{
+    params->ifilenames.clear();
+    if (!job.input.empty())
+        params->ifilenames.push_back(job.input.c_str());
+    params->ofilename = job.output.empty() ? 0 : job.output.c_str();
+    params->outdir = job.outdir.c_str();
+    params->chapter_mode = job.chapters;
+    params->cuesheet = job.cuesheet.empty() ? 0 : job.cuesheet.c_str();
+    if (!job.cuesheet_encoding.empty())
+        params->cuesheet_encoding = job.cuesheet_encoding.c_str();
+    if ((!job.start.empty()
+         && !parse_timespec(job.start.c_str(), &params->start))
+        || (!job.end.empty()
+            && !parse_timespec(job.end.c_str(), &params->end)))
+        throw std::runtime_error("malformed timespec");
+    for (auto r = job.ranges.begin(); r != job.ranges.end(); ++r) {
+        TimeRange range;
+        if (!parse_range(r->c_str(), &range))
+            throw std::runtime_error("malformed range " + *r);
+        params->ranges.push_back(range);
+    }
+}
+
+/* run a job of --batch or --serve */
+void run_job(const params_t &params, const BatchJob &job)
+{
+    if (!job.error.empty())
+        throw std::runtime_error(job.error);
+    params_t job_params = params;
+    job_params.batch_file = 0;
+    job_params.serve_socket = 0;
+    /* FILEs in cuesheet are processed serially inside of the job */
+    job_params.jobs = 1;
+    batch_job_params(job, &job_params);
+    run(job_params, false);
+}
+
+/* run the job under the lease, and record the result in status file */
+void run_leased_job(const params_t &params, LeaseDir &leases,
+                    const BatchJob &job, const std::string &key)
+{
+    std::string error;
+    try {
+        run_job(params, job);
+    } catch (const std::exception &e) {
+        error = e.what();
+    }
+    std::stringstream ss;
+    ss << "{\"manifest\":" << json_quote(params.batch_file)
+       << ",\"line\":" << job.lineno
+       << ",\"job\":" << json_quote(job.text)
+       << ",\"ok\":" << (error.empty() ? "true" : "false");
+    if (!error.empty())
+        ss << ",\"error\":" << json_quote(error);
+    ss << "}";
+    leases.release(key, ss.str());
+    if (!error.empty())
+        throw std::runtime_error(error);
+}
+
+/*
+ * run jobs in the manifest on the worker pool.
+ * jobs are started in descending order of input size, so that large
+ * inputs won't be left to the end of the batch.
+ *
+ * with --lease-dir, jobs are shared with other workers through lease
+ * files, and jobs leased by others are retried until they are done, so
+ * that leases of dead workers are taken over. failure of a job run by
+ * another worker is reported as ours.
+ */
+void run_batch(const params_t &params)
+{
+    std::vector<BatchJob> jobs;
+    load_batch_manifest(params.batch_file, &jobs);
+    for (auto job = jobs.begin(); job != jobs.end(); ++job) {
+        aa_stat_t st;
+        const std::string &name = job->input.empty() ? job->cuesheet
+                                                     : job->input;
+        if (aa_stat(name.c_str(), &st) == 0)
+            job->cost = st.size;
+    }
+    std::stable_sort(jobs.begin(), jobs.end(),
+                     [](const BatchJob &a, const BatchJob &b) {
+                         return a.cost > b.cost;
+                     });
+    std::shared_ptr<LeaseDir> leases;
+    if (params.lease_dir)
+        leases = std::make_shared<LeaseDir>(params.lease_dir,
+                                            params.lease_timeout);
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < jobs.size(); ++i)
+        pending.push_back(i);
+    unsigned nerrors = 0;
+    bool waited = false;  /* pending jobs were leased by other workers */
+    while (pending.size()) {
+        std::vector<std::string> names;
+        for (auto i = pending.begin(); i != pending.end(); ++i) {
+            std::stringstream ss;
+            ss << params.batch_file << ":" << jobs[*i].lineno << ": "
+               << jobs[*i].name();
+            names.push_back(ss.str());
+        }
+        /* 1: leased by another worker */
+        std::vector<char> busy(pending.size());
+        nerrors += run_in_parallel(params, names, [&](size_t n) {
+            const BatchJob &job = jobs[pending[n]];
+            if (!leases) {
+                run_job(params, job);
+                return;
+            }
+            std::string key = job.key();
+            std::string error;
+            switch (leases->status(key, &error)) {
+            case LeaseDir::SUCCEEDED:
+                return;
+            case LeaseDir::FAILED:
+                /*
+                 * failure of a previous batch is retried, but not the
+                 * one of another worker we have been waiting for
+                 */
+                if (waited)
+                    throw std::runtime_error(error);
+                break;
+            default:
+                break;
+            }
+            if (!leases->acquire(key)) {
+                busy[n] = 1;
+                return;
+            }
+            run_leased_job(params, *leases, job, key);
+        });
+        std::vector<size_t> rest;
+        for (size_t n = 0; n < pending.size(); ++n)
+            if (busy[n]) rest.push_back(pending[n]);
+        pending.swap(rest);
+        waited = true;
+        if (pending.size())
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(leases->timeout() * 1000 / 3));
+    }
+    if (nerrors) {
+        std::stringstream ss;
+        ss << nerrors << " of " << jobs.size() << " jobs in batch failed";
+        throw std::runtime_error(ss.str());
+    }
+}
+
+/* run a request of --serve, and return the response */
+std::string serve_request(const params_t &params, const std::string &line)
+{
+    BatchJob job;
+    std::string error;
+    try {
+        parse_batch_job(line, &job);
+        run_job(params, job);
+    } catch (const std::exception &e) {
+        error = e.what();
+        aa_fprintf(stderr, "%s: %s\n", job.name().c_str(), error.c_str());
+    }
+    /* server doesn't end by itself, so manifest is saved on each request */
+    if (params.manifest) {
+        try {
+            params.manifest->save(false);
+        } catch (const std::exception &e) {
+            aa_fprintf(stderr, "%s\n", e.what());
+        }
+    }
+    std::stringstream ss;
+    ss << "{\"id\":" << (job.id.empty() ? "null" : json_quote(job.id))
+       << ",\"ok\":" << (error.empty() ? "true" : "false");
+    if (!error.empty())
+        ss << ",\"error\":" << json_quote(error);
+    ss << "}";
+    return ss.str();
+}
+
+#ifndef _WIN32
+UnixServer *g_server;
+
+void stop_server(int)
+{
+    g_server->stop();
+}
+#endif
+
+/* serve until SIGINT or SIGTERM, and return after requests in progress */
+void serve(params_t params)
+{
+#ifdef _WIN32
+    throw std::runtime_error("--serve is not supported on this platform");
+#else
+    size_t cache_size = params.cache_size ? params.cache_size : 256;
+    params.input_cache = std::make_shared<InputCache>(cache_size << 20);
+    UnixServer server(params.serve_socket, [&](const std::string &line) {
+        return serve_request(params, line);
+    });
+    g_server = &server;
+    std::signal(SIGINT, stop_server);
+    std::signal(SIGTERM, stop_server);
+    aa_fprintf(stderr, "listening on %s\n", params.serve_socket);
+    try {
+        server.run();
+    } catch (...) {
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        throw;
+    }
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+#endif
+}
+
 } // end of empty namespace
 
 int main(int argc, char **argv)
 {
-    params_t params = { 0 };
+    params_t params = params_t();
+    params.lease_timeout = 300;
+    params.journal_sync = 64;
+    params.result_cache_size = 1024;
 
     std::setlocale(LC_CTYPE, "");
     std::setbuf(stderr, 0);
@@ -335,32 +1411,45 @@ int main(int argc, char **argv)
     if (!parse_options(argc, argv, &params))
         return 1;
     try {
-        M4ATrimmer trimmer;
-        trimmer.open_input(params.ifilename);
-        if (params.sbr_delay_fix)
-            trimmer.shift_edits(params.sbr_delay_fix * 481);
-        if (params.cuesheet)
-            process_cuesheet(trimmer, params);
-        else if (params.chapter_mode) {
-            auto chapters = trimmer.chapters();
-            if (!chapters.size())
-                throw std::runtime_error("no chapters in the file");
-            for (size_t i = 0; i < chapters.size(); ++i) {
-                std::stringstream ss;
-                ss << std::setfill('0') << std::setw(2) << (i + 1)
-                   << ' ' << safe_filename(chapters[i].second) << ".m4a";
-                aa_fprintf(stderr, "%s\n", ss.str().c_str());
-                trimmer.open_output(ss.str());
-                trimmer.select_chapter(i);
-                process_file(trimmer);
-            }
-        } else {
-            trimmer.open_output(params.ofilename);
-            trimmer.select_cut_point(params.start, params.end);
-            process_file(trimmer);
-        }
+        if (params.manifest_file && !params.plan_mode)
+            params.manifest =
+                std::make_shared<PlanManifest>(params.manifest_file);
+        if (params.memory_limit)
+            params.memory_budget = std::make_shared<MemoryBudget>(
+                static_cast<uint64_t>(params.memory_limit) << 20);
+        if (params.result_cache_dir && !params.plan_mode)
+            params.result_cache = std::make_shared<ResultCache>(
+                params.result_cache_dir,
+                static_cast<uint64_t>(params.result_cache_size) << 20);
+        if (params.journal_file)
+            params.journal =
+                std::make_shared<OutputJournal>(params.journal_file,
+                                                params.journal_sync);
+        if (params.batch_file)
+            run_batch(params);
+        else if (params.serve_socket)
+            serve(params);
+        else if (params.probe_mode)
+            probe(params);
+        else
+            run(params);
+        if (params.journal)
+            params.journal->flush();
+        /* server sees only the outputs requested */
+        if (params.manifest)
+            params.manifest->save(!params.serve_socket);
     } catch (std::exception &e) {
         aa_fprintf(stderr, "\r%s\n", e.what());
+        if (params.journal) {
+            try {
+                params.journal->flush();
+            } catch (...) {}
+        }
+        if (params.manifest) {
+            try {
+                params.manifest->save(false);
+            } catch (...) {}
+        }
         return 2;
     }
     return 0;
@@ -0,0 +1,95 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+/*
+ * round trip of random fields through BitWriter and BitReader.
+ */
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "bitstream.h"
+
+namespace {
+    struct Field {
+        uint32_t value;
+        uint32_t nbits;
+        bool skipped;  /* read by skip() instead of get() */
+    };
+
+    unsigned check_round_trip(std::mt19937 &rng, unsigned iteration)
+    {
+        std::vector<Field> fields(rng() % 200);
+        BitWriter writer(rng() % 16);
+        size_t nbits = 0;
+        for (size_t i = 0; i < fields.size(); ++i) {
+            Field &f = fields[i];
+            f.nbits = rng() % 33;
+            f.value = f.nbits ? uint32_t(rng()) >> (32 - f.nbits) : 0;
+            f.skipped = rng() % 8 == 0;
+            writer.put(f.value, f.nbits);
+            nbits += f.nbits;
+        }
+        if (writer.position() != nbits) {
+            std::fprintf(stderr, "%u: writer position %zu, expected %zu\n",
+                         iteration, writer.position(), nbits);
+            return 1;
+        }
+        std::vector<uint8_t> data;
+        writer.take(&data);
+        if (data.size() != (nbits + 7) / 8 || writer.position() != 0) {
+            std::fprintf(stderr, "%u: %zu bytes taken, expected %zu\n",
+                         iteration, data.size(), (nbits + 7) / 8);
+            return 1;
+        }
+
+        BitReader reader(data.data(), data.size());
+        for (size_t i = 0; i < fields.size(); ++i) {
+            const Field &f = fields[i];
+            if (f.skipped) {
+                reader.skip(f.nbits);
+                continue;
+            }
+            if (reader.peek(f.nbits) != f.value
+                || reader.get(f.nbits) != f.value)
+            {
+                std::fprintf(stderr, "%u: field %zu mismatch\n", iteration, i);
+                return 1;
+            }
+        }
+        if (reader.position() != nbits || reader.overrun()) {
+            std::fprintf(stderr, "%u: reader position %zu, expected %zu\n",
+                         iteration, reader.position(), nbits);
+            return 1;
+        }
+        /* padding of the last byte is zero, and reading past the end too */
+        if (reader.get(uint32_t(-nbits & 7)) != 0 || reader.remaining() != 0
+            || reader.get(32) != 0 || !reader.overrun())
+        {
+            std::fprintf(stderr, "%u: reading past the end\n", iteration);
+            return 1;
+        }
+        /* seek back, and read the fields again */
+        size_t pos = 0;
+        for (size_t i = 0; i < fields.size(); ++i) {
+            const Field &f = fields[i];
+            reader.seek(pos);
+            if (reader.get(f.nbits) != f.value) {
+                std::fprintf(stderr, "%u: field %zu mismatch after seek\n",
+                             iteration, i);
+                return 1;
+            }
+            pos += f.nbits;
+        }
+        return 0;
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    unsigned failures = 0;
+    for (unsigned i = 0; i < 20000 && failures < 10; ++i)
+        failures += check_round_trip(rng, i);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+/*
+ * lookups and crops of MP4Edits against linear scans of the edit list,
+ * on random edit lists.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <utility>
+#include <vector>
+#include "MP4Edits.h"
+
+namespace {
+    typedef std::vector<std::pair<int64_t, int64_t> > list_t;
+
+    list_t entries(const MP4Edits &edits)
+    {
+        list_t list;
+        for (unsigned i = 0; i < edits.count(); ++i)
+            list.push_back(std::make_pair(edits.offset(i), edits.duration(i)));
+        return list;
+    }
+
+    /* media offset of the position, scanning from the first edit */
+    int64_t linear_media_offset(const list_t &list, int64_t position)
+    {
+        int64_t start = 0;
+        for (size_t i = 0; i < list.size(); ++i) {
+            if (position < start + list[i].second || i == list.size() - 1)
+                return list[i].first + position - start;
+            start += list[i].second;
+        }
+        return 0;
+    }
+
+    /* parts of edits overlapping each of windows */
+    list_t linear_crop(const list_t &list, const list_t &windows)
+    {
+        list_t result;
+        for (size_t w = 0; w < windows.size(); ++w) {
+            int64_t start = 0;
+            for (size_t i = 0; i < list.size(); ++i) {
+                int64_t end = start + list[i].second;
+                int64_t s = std::max(start, windows[w].first);
+                int64_t e = std::min(end, windows[w].second);
+                if (s < e) {
+                    int64_t offset = list[i].first;
+                    if (offset >= 0)
+                        offset += s - start;
+                    result.push_back(std::make_pair(offset, e - s));
+                }
+                start = end;
+            }
+        }
+        return result;
+    }
+
+    MP4Edits random_edits(std::mt19937 &rng, list_t *list)
+    {
+        MP4Edits edits;
+        list->clear();
+        unsigned count = 1 + rng() % 20;
+        for (unsigned i = 0; i < count; ++i) {
+            /* empty edits (-1) now and then */
+            int64_t offset = rng() % 8 ? int64_t(rng() % 100000) : -1;
+            int64_t duration = 1 + rng() % 5000;
+            edits.add_entry(offset, duration);
+            list->push_back(std::make_pair(offset, duration));
+        }
+        return edits;
+    }
+
+    /* ascending, non-overlapping windows within [0, total) */
+    list_t random_windows(std::mt19937 &rng, int64_t total)
+    {
+        std::vector<int64_t> bounds;
+        unsigned count = 2 * (1 + rng() % 4);
+        for (unsigned i = 0; i < count; ++i)
+            bounds.push_back(rng() % (total + 1));
+        std::sort(bounds.begin(), bounds.end());
+        list_t windows;
+        for (unsigned i = 0; i < count; i += 2)
+            if (bounds[i] < bounds[i + 1])
+                windows.push_back(std::make_pair(bounds[i], bounds[i + 1]));
+        return windows;
+    }
+
+    unsigned check(std::mt19937 &rng, unsigned iteration)
+    {
+        list_t list;
+        MP4Edits edits = random_edits(rng, &list);
+        int64_t total = 0;
+        for (size_t i = 0; i < list.size(); ++i)
+            total += list[i].second;
+        if (int64_t(edits.total_duration()) != total) {
+            std::fprintf(stderr, "%u: total_duration mismatch\n", iteration);
+            return 1;
+        }
+        std::vector<int64_t> positions, offsets;
+        for (unsigned i = 0; i < 50; ++i)
+            positions.push_back(rng() % (total + 100));
+        if (rng() % 2)
+            std::sort(positions.begin(), positions.end());
+        edits.media_offsets_for_positions(positions, &offsets);
+        for (size_t i = 0; i < positions.size(); ++i) {
+            int64_t expected = linear_media_offset(list, positions[i]);
+            if (edits.media_offset_for_position(positions[i]) != expected
+                || offsets[i] != expected)
+            {
+                std::fprintf(stderr, "%u: media offset of %lld mismatch\n",
+                             iteration, static_cast<long long>(positions[i]));
+                return 1;
+            }
+        }
+        list_t windows = random_windows(rng, total);
+        if (windows.empty())
+            return 0;
+        MP4Edits cropped = edits;
+        if (windows.size() == 1)
+            cropped.crop(windows[0].first, windows[0].second);
+        else
+            cropped.crop(windows);
+        if (entries(cropped) != linear_crop(list, windows)) {
+            std::fprintf(stderr, "%u: crop mismatch\n", iteration);
+            return 1;
+        }
+        return 0;
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    unsigned failures = 0;
+    for (unsigned i = 0; i < 50000 && failures < 10; ++i)
+        failures += check(rng, i);
+    return failures ? 1 : 0;
+}
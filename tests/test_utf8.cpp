@@ -0,0 +1,138 @@
+/* 
+ * Copyright (C) 2014 nu774
+ * For conditions of distribution and use, see copyright notice in COPYING
+ */
+/*
+ * utf8_valid_length() and StringConverterUTF8::validate() against a
+ * decoder which checks the decoded code point, on random strings.
+ * only the path chosen for the running CPU (AVX2, SSSE3 or scalar) is
+ * exercised.
+ */
+#include <cstdio>
+#include <random>
+#include <string>
+#include "StringConverterUTF8.h"
+
+namespace {
+    /* length of the valid UTF-8 prefix, by decoding code points */
+    size_t reference_length(const std::string &s)
+    {
+        size_t i = 0;
+        while (i < s.size()) {
+            unsigned c = static_cast<unsigned char>(s[i]);
+            size_t len;
+            uint32_t cp, min;
+            if (c < 0x80)                { len = 1; cp = c; min = 0; }
+            else if ((c & 0xe0) == 0xc0) { len = 2; cp = c & 0x1f; min = 0x80; }
+            else if ((c & 0xf0) == 0xe0) { len = 3; cp = c & 0x0f; min = 0x800; }
+            else if ((c & 0xf8) == 0xf0) { len = 4; cp = c & 0x07; min = 0x10000; }
+            else return i;
+            if (i + len > s.size())
+                return i;
+            for (size_t k = 1; k < len; ++k) {
+                unsigned t = static_cast<unsigned char>(s[i + k]);
+                if ((t & 0xc0) != 0x80)
+                    return i;
+                cp = cp << 6 | (t & 0x3f);
+            }
+            if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp < 0xe000))
+                return i;
+            i += len;
+        }
+        return i;
+    }
+
+    const char *pieces[] = {
+        /* valid */
+        "\xc2\x80", "\xc3\xa9", "\xdf\xbf", "\xe0\xa0\x80", "\xe3\x81\x82",
+        "\xed\x9f\xbf", "\xee\x80\x80", "\xef\xbf\xbf", "\xf0\x90\x80\x80",
+        "\xf0\x9f\x98\x80", "\xf4\x8f\xbf\xbf",
+        /* invalid: stray continuation, overlongs, surrogate, too large */
+        "\x80", "\xbf", "\xc0\xaf", "\xc1\xbf", "\xe0\x80\xaf",
+        "\xe0\x9f\xbf", "\xed\xa0\x80", "\xf0\x80\x80\x80",
+        "\xf0\x8f\xbf\xbf", "\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xff",
+        /* truncated */
+        "\xc3", "\xe3\x81", "\xf0\x9f\x98"
+    };
+    const size_t valid_pieces = 11;
+    const size_t npieces = sizeof(pieces) / sizeof(pieces[0]);
+
+    std::string random_text(std::mt19937 &rng)
+    {
+        std::string s;
+        unsigned count = rng() % 100;
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned r = rng() % 100;
+            if (r < 45)
+                s.append(rng() % 40, char('a' + rng() % 26));
+            else if (r < 95)
+                s += pieces[rng() % valid_pieces];
+            else
+                s += pieces[rng() % npieces];
+        }
+        if (rng() % 4 == 0) {
+            for (int i = 0; i < 3 && s.size(); ++i)
+                s[rng() % s.size()] = char(rng());
+        }
+        return s;
+    }
+
+    size_t reference_ascii_length(const std::string &s)
+    {
+        size_t i = 0;
+        while (i < s.size() && !(s[i] & 0x80))
+            ++i;
+        return i;
+    }
+
+    /* validate s split into random chunks */
+    bool validate_chunks(const std::string &s, std::mt19937 &rng)
+    {
+        StringConverterUTF8 validator;
+        size_t pos = 0;
+        do {
+            size_t n = std::min<size_t>(rng() % 48, s.size() - pos);
+            bool flush = pos + n == s.size();
+            if (!validator.validate(s.data() + pos, n, flush))
+                return false;
+            pos += n;
+        } while (pos < s.size());
+        return true;
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    unsigned failures = 0;
+    for (unsigned i = 0; i < 200000 && failures < 10; ++i) {
+        std::string s = random_text(rng);
+        size_t expected = reference_length(s);
+        size_t actual = utf8_valid_length(s.data(), s.size());
+        if (actual != expected) {
+            std::fprintf(stderr, "utf8_valid_length: %u: %zu, expected %zu\n",
+                         i, actual, expected);
+            ++failures;
+        }
+        size_t error_offset = 0;
+        StringConverterUTF8 validator;
+        bool valid = validator.validate(s.data(), s.size(), true,
+                                        &error_offset);
+        if (valid != (expected == s.size())
+            || (!valid && error_offset != expected))
+        {
+            std::fprintf(stderr, "validate: %u: error at %zu, expected %zu\n",
+                         i, error_offset, expected);
+            ++failures;
+        }
+        if (validate_chunks(s, rng) != (expected == s.size())) {
+            std::fprintf(stderr, "validate in chunks: %u: wrong result\n", i);
+            ++failures;
+        }
+        if (ascii_length(s.data(), s.size()) != reference_ascii_length(s)) {
+            std::fprintf(stderr, "ascii_length: %u: wrong result\n", i);
+            ++failures;
+        }
+    }
+    return failures ? 1 : 0;
+}